@@ -14,6 +14,9 @@ PKGCONFIG += libbitcoin-database libczmq
 QMAKE_CXXFLAGS += -g -DSQLPP_USE_SQLCIPHER -DSQLITE_HAS_CODEC -DSQLITE_TEMP_STORE=2
 LIBS += -lsqlpp11-connector-sqlite3 -lsqlcipher -lcrypto
 
+# Hardware popcount for the blockchain live bitmap
+contains(QT_ARCH, x86_64): QMAKE_CXXFLAGS += -mpopcnt
+
 # The following define makes your compiler warn you if you use any
 # feature of Qt which has been marked as deprecated (the exact warnings
 # depend on your compiler). Please consult the documentation of the
@@ -40,9 +43,19 @@ SOURCES += main.cpp \
     src/wallet.cpp \
     src/blockchain_client.cpp \
     src/blockchain_server.cpp \
+    src/blockchain_snapshot.cpp \
     src/blockchain.cpp \
+    src/chain_feed.cpp \
+    src/chain_sequencer.cpp \
+    src/commitment_index.cpp \
+    src/endpoints.cpp \
+    src/kernel_journal.cpp \
+    src/logger.cpp \
+    src/merkle_tree.cpp \
     src/transaction.cpp \
     src/message_client.cpp \
     src/message_server.cpp \
+    src/metrics.cpp \
+    src/point_cache.cpp \
     src/utility.cpp
 
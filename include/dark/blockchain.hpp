@@ -1,7 +1,16 @@
 #ifndef DARK_BLOCKCHAIN_HPP
 #define DARK_BLOCKCHAIN_HPP
 
+#include <atomic>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
+#include <functional>
+#include <istream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <boost/optional.hpp>
 #include <bitcoin/system.hpp>
 #include <bitcoin/database/primitives/record_manager.hpp>
 #include <bitcoin/database/memory/file_storage.hpp>
@@ -12,35 +21,417 @@ namespace bcs = bc::system;
 
 typedef uint32_t output_index_type;
 
+typedef std::vector<output_index_type> output_index_list;
+
+// Commits are numbered from 1 since the chain was opened. Generation 0
+// is the state the chain was opened with.
+typedef uint32_t generation_type;
+
+struct output_record
+{
+    bcs::ec_compressed point;
+    uint32_t time;
+};
+
+typedef std::function<void (output_index_type)> live_index_handler;
+typedef std::function<void (output_index_type, const output_record&)>
+    live_record_handler;
+// Receives an index and its creation time. Return false to stop.
+typedef std::function<bool (output_index_type, uint32_t)>
+    time_entry_handler;
+
 constexpr size_t blockchain_record_size = bcs::ec_compressed_size + 4;
 
+// How output records are laid out on disk, fixed when a chain is created.
+enum class record_layout
+{
+    // [point:33][time:4] records, spent ones with a zeroed prefix byte.
+    classic = 1,
+    // Columns of 32 byte aligned x coordinates and times, with the y
+    // parity in a bitmap and liveness only in the live bitmap. Spent
+    // records still read back with a zeroed prefix byte.
+    dense = 2
+};
+
+class commitment_index;
+class merkle_tree;
+class record_versions;
+struct blockchain_shard;
+class blockchain_snapshot;
+
+typedef std::shared_ptr<const blockchain_snapshot> snapshot_ptr;
+
+// Removes and puts staged to be applied to the chain in one commit.
+// A batch can hold several transactions for group commit.
+class blockchain_batch
+{
+public:
+    void put(const bcs::ec_compressed& point);
+    void remove(const output_index_type index);
+
+    // Stages every remove and put of other after those already here.
+    void append(const blockchain_batch& other);
+
+    // Whether the index is already staged for removal in this batch.
+    bool is_removed(const output_index_type index) const;
+    // Whether the point is already staged as a new output in this batch.
+    bool is_put(const bcs::ec_compressed& point) const;
+    // Whether other removes an index this batch already removes.
+    bool overlaps(const blockchain_batch& other) const;
+
+    size_t puts_count() const;
+    bool empty() const;
+
+    const output_index_list& removes() const;
+    const bcs::point_list& puts() const;
+
+private:
+    friend class blockchain;
+
+    output_index_list removes_;
+    bcs::point_list puts_;
+};
+
+// When committed batches reach the disk. The outputs themselves are
+// only synced at checkpoints, since the journal can replay them. Outside
+// commit mode a crash may lose a batch after part of it reached the
+// outputs, so the files derived from them are rebuilt on the next open.
+enum class durability_mode
+{
+    // Left to kernel writeback. A crash may lose any recent commit.
+    none,
+    // Synced in the background every interval or after some records.
+    group,
+    // Synced before each commit returns.
+    commit
+};
+
+struct durability_policy
+{
+    durability_mode mode = durability_mode::commit;
+    // Group mode syncs once either limit is reached
+    uint32_t interval_ms = 10;
+    uint32_t records = 1024;
+};
+
+// Journal sync latencies since the chain was opened.
+struct flush_stats
+{
+    uint64_t flushes = 0;
+    uint64_t total_microseconds = 0;
+    uint64_t max_microseconds = 0;
+};
+
+// Outcome of an integrity pass over the unspent records.
+struct verify_report
+{
+    output_index_type checked = 0;
+    // The lowest indexes whose points are not on the curve, up to the
+    // requested limit.
+    output_index_list bad;
+};
+
+// Path from one slot's leaf to the state root. Siblings run from the
+// leaves upwards.
+struct merkle_proof
+{
+    output_index_type index = 0;
+    bcs::hash_digest root;
+    bcs::hash_list siblings;
+};
+
+typedef std::vector<std::pair<output_index_type, bcs::hash_digest>>
+    merkle_leaf_list;
+
+// How the outputs files grow once their mapped capacity runs out. Each
+// growth remaps the file and stalls readers, so grow well ahead of use.
+enum class growth_mode
+{
+    // A fixed number of records beyond what is needed
+    fixed,
+    // A percentage of the current capacity
+    geometric
+};
+
+struct growth_policy
+{
+    growth_mode mode = growth_mode::geometric;
+    uint32_t chunk_records = 65536;
+    uint32_t percent = 50;
+};
+
 class blockchain
 {
 public:
-    blockchain(const char* prefix = "blockchain");
+    // The shard count and layout only apply when a new chain is
+    // created. Chains with one shard keep the original single outputs
+    // file layout.
+    blockchain(const char* prefix = "blockchain", size_t shards = 1,
+        record_layout layout = record_layout::classic);
     ~blockchain();
 
+    // Rewrites a closed classic chain into the dense layout. Returns
+    // false if the chain is already dense.
+    static bool convert_to_dense(const char* prefix);
+
+    // Builds a new chain at prefix from a blockchain_snapshot file in one
+    // sequential pass, keeping every output's index. Returns false if
+    // the prefix exists or the file is corrupt.
+    static bool import_file(const char* path, const char* prefix);
+
+    // The shard a new output with this commitment is placed in, so that
+    // find() only checks that one shard.
+    static size_t shard_for(const bcs::ec_compressed& point, size_t shards);
+
     // non-copyable
     blockchain(const blockchain&) = delete;
 
     output_index_type put(const bcs::ec_compressed& point);
-    const uint8_t* get(const output_index_type index) const;
+    output_record get(const output_index_type index) const;
 
-    void remove(const output_index_type index);
+    // Returns false if the output is not unspent.
+    bool remove(const output_index_type index);
     bool exists(const output_index_type index);
 
+    // Looks up the unspent output holding this commitment.
+    boost::optional<output_index_type> find(
+        const bcs::ec_compressed& point) const;
+
+    // Allocated slots, spent or not. Valid indexes are below this.
     output_index_type count() const;
+    // Unspent outputs, counted from the live bitmap.
+    output_index_type live_count() const;
+
+    // Sum of every unspent commitment, or none if nothing is unspent.
+    // Maintained by each commit instead of summed on demand.
+    boost::optional<bcs::ec_compressed> commitment_sum() const;
+
+    size_t shards_count() const;
+    record_layout layout() const;
+
+    // Calls the handler with each unspent index in [first, last),
+    // skipping whole words of spent slots. The handler must not
+    // modify the chain.
+    void for_each_live_index(output_index_type first, output_index_type last,
+        live_index_handler handler) const;
+
+    // Walks the unspent records in [first, last) over a single pinned
+    // mapping of the outputs files, with sequential read hints. The
+    // handler must not modify the chain.
+    void for_each_live(output_index_type first, output_index_type last,
+        live_record_handler handler) const;
+
+    // Journals the batch, then applies all of it under one commit.
+    // Returns the indexes allocated for the puts in staging order, or
+    // none without changing anything if a remove is not an unspent
+    // output or is staged twice. Batches touching different shards may
+    // commit from several threads at once.
+    boost::optional<output_index_list> commit(const blockchain_batch& batch);
+
+    // Flushes the outputs to disk and truncates the journal.
+    void checkpoint();
+
+    // Defaults to syncing every commit.
+    void set_durability(const durability_policy& policy);
+    durability_policy durability() const;
+    flush_stats journal_flush_stats() const;
+    // Checkpoints taken since the chain was opened.
+    size_t checkpoints() const;
+
+    // Defaults to geometric growth by half.
+    void set_growth(const growth_policy& policy);
+    // Times the outputs files were grown and remapped since opening.
+    size_t records_remaps() const;
+
+    // Checks that every unspent record holds a valid curve point,
+    // splitting the chain across threads (all cores by default). Runs
+    // over a snapshot, so commits may continue meanwhile.
+    verify_report verify(size_t threads = 0, size_t report_limit = 16) const;
+
+    // Merkle root over every output index as of the latest commit. Equal
+    // chains have equal roots, however many slots they allocated.
+    bcs::hash_digest state_root() const;
+    // Proves the slot's record, or that it is spent or free, against
+    // the current state root. None if the index was never allocated.
+    boost::optional<merkle_proof> state_proof(
+        const output_index_type index) const;
+
+    // Pins a consistent view as of the latest commit. Readers on other
+    // threads use this so they never see half of a batch. Snapshots
+    // must be released before the chain is destroyed.
+    snapshot_ptr snapshot() const;
 
 private:
+    friend class blockchain_snapshot;
+
     typedef std::unique_ptr<bc::database::file_storage> storage_uniq;
+    typedef std::unique_ptr<blockchain_shard> shard_uniq;
+    typedef std::vector<shard_uniq> shard_list;
+
+    struct staged_output
+    {
+        output_index_type index;
+        bcs::ec_compressed point;
+    };
+    typedef std::vector<staged_output> staged_output_list;
+
+    // Global indexes interleave the shards: index = slot * shards + shard
+    size_t shard_of(const output_index_type index) const;
+    output_index_type slot_of(const output_index_type index) const;
+    size_t shard_for(const bcs::ec_compressed& point) const;
+    // Whether the index falls inside its shard's allocated records.
+    bool allocated(const output_index_type index) const;
+
+    // Opens or creates the shard's record files for the chain's layout.
+    void open_shard_records(blockchain_shard& shard, const char* prefix,
+        size_t shard_index, size_t shards);
+    // Reads a record in either layout, spent ones with a zero prefix.
+    // The index must be allocated.
+    output_record read_record(const output_index_type index) const;
+    // Whether the index is set in the live bitmap.
+    bool live(const output_index_type index) const;
+
+    // Fills a new chain from the records of a snapshot file.
+    bool import_records(std::istream& file, output_index_type chain_count,
+        output_index_type live, uint64_t checksum);
+
+    // Whether every index is unspent and staged once. Callers hold the
+    // locks of the shards involved.
+    bool removable(const output_index_list& removes) const;
+    // Assigns indexes to puts from the free stacks then the end of file.
+    staged_output_list resolve_outputs(const bcs::point_list& puts);
+    void write_record(const output_index_type index,
+        const bcs::ec_compressed& point, const uint32_t time);
+    // Marks a record spent in the record itself, for the classic layout.
+    void tombstone_record(const output_index_type index);
+    // Appends slots to a shard, growing its files by the growth policy.
+    void allocate_records(blockchain_shard& shard, size_t added);
+    // Grows the shard's outputs file by the growth policy if added more
+    // records would not fit in its current capacity.
+    void reserve_records(blockchain_shard& shard, size_t added);
+    // Pushes a spent slot onto its shard's free stack for reuse by put().
+    // Slots still live or already on the stack are refused.
+    void release_record(const output_index_type index);
+    // Frees slots removed before the oldest snapshot still open.
+    void release_pending_records(blockchain_shard& shard);
+    // Recreates the free stacks from the gaps in the live bitmap.
+    void rebuild_free_records();
+    // Notes which slots the free stacks hold. Returns false if a stack
+    // holds a live slot or one slot twice.
+    bool load_free_slots();
+
+    // Grows the live bitmap to cover every allocated record.
+    void reserve_live_bitmap();
+    void set_live(const output_index_type index, bool live);
+    // Recreates the live bitmap from the record prefix bytes.
+    void rebuild_live_bitmap();
+
+    // Recreates the commitment indexes from the live records.
+    void rebuild_commitment_index();
+
+    // Recreates the commitment sum by adding up the live records.
+    void rebuild_commitment_sum();
+
+    // Stamps the frame with its commit time and returns its generation.
+    generation_type append_journal(uint32_t& time,
+        const output_index_list& removes, const staged_output_list& puts);
+    // Replays intact journal frames left behind by a crash, and rebuilds
+    // the files derived from the outputs if the chain was not clean.
+    void recover_journal();
+    // Records whether everything since the last checkpoint is synced.
+    // Called with the journal lock held.
+    void set_clean(bool clean);
+
+    // Syncs the journal as the durability policy asks after a commit
+    // journaled this many removes and puts.
+    void journal_written(size_t records);
+    void flush_journal();
+    // Background syncs for group durability.
+    void run_flusher();
+    void stop_flusher();
+
+    // Indexes the puts of a commit by time, in journal order.
+    void append_times(const uint32_t time, const staged_output_list& puts);
+    // Recreates the time index from the live records, dropping spent
+    // outputs.
+    void rebuild_time_index();
+    // Walks time index entries in [from, to), oldest first. Entries of
+    // spent or reused slots are included, so callers must check them.
+    void for_each_created(const uint32_t from, const uint32_t to,
+        time_entry_handler handler) const;
+    // Walks time index entries newest first.
+    void for_each_newest(time_entry_handler handler) const;
+
+    // Hashes every unspent record into a fresh state tree.
+    void rebuild_merkle_tree();
+
+    // Makes a commit visible once every earlier commit is, applying its
+    // state tree leaves in the same order.
+    void publish(generation_type generation, const merkle_leaf_list& leaves);
+
+    // Passes the records of the ascending indexes from one pinned
+    // mapping.
+    void read_records(const output_index_list& indexes,
+        live_record_handler handler) const;
+    // Slots in [first, last) spent by commits after the generation and
+    // still held back from the free stack, in no particular order.
+    output_index_list removed_after(generation_type generation,
+        output_index_type first, output_index_type last) const;
+
+    void release_snapshot(generation_type generation) const;
+
+    // Record files, free stacks and commitment indexes per shard.
+    record_layout layout_;
+    shard_list shards_;
+    growth_policy growth_;
+    std::mutex growth_mutex_;
+    std::atomic<size_t> records_remaps_{ 0 };
+
+    // One bit per record, set while the output is unspent.
+    storage_uniq live_storage_;
+
+    // Running sum of the live commitments. All zero for none.
+    storage_uniq sum_storage_;
+    mutable std::mutex sum_mutex_;
+
+    // Write-ahead journal of committed batches since the last checkpoint.
+    std::mutex journal_mutex_;
+    storage_uniq journal_storage_;
+    size_t journal_end_;
+    uint64_t journal_sequence_;
+    generation_type journal_generation_;
+    uint32_t journal_time_;
+    // One byte set at each checkpoint and cleared by the next commit.
+    storage_uniq clean_storage_;
+    bool clean_ = false;
+    std::atomic<size_t> checkpoints_{ 0 };
+
+    // Output indexes sorted by creation time.
+    storage_uniq times_storage_;
+    std::unique_ptr<bc::database::record_manager<output_index_type>> times_;
+    mutable std::mutex times_mutex_;
 
-    typedef bc::database::record_manager<output_index_type> records_type;
-    typedef std::unique_ptr<records_type> records_uniq;
+    // Durability policy, the group flusher and sync latencies.
+    durability_policy durability_;
+    mutable std::mutex durability_mutex_;
+    std::condition_variable durability_condition_;
+    std::thread flusher_;
+    bool stopping_ = false;
+    size_t unflushed_records_ = 0;
+    flush_stats flush_stats_;
 
-    output_index_type next_available_record();
+    // Visibility of each record to snapshots, and the open snapshots.
+    std::unique_ptr<record_versions> versions_;
+    std::atomic<generation_type> generation_;
+    mutable std::mutex publish_mutex_;
+    std::condition_variable publish_condition_;
+    mutable std::mutex snapshots_mutex_;
+    mutable std::multiset<generation_type> snapshots_;
 
-    storage_uniq records_storage_;
-    records_uniq records_;
+    // State tree as of the latest published commit, saved by a clean
+    // close so the next open need not rehash every record
+    std::unique_ptr<merkle_tree> merkle_;
+    std::string merkle_path_;
 };
 
 } // namespace dark
@@ -11,25 +11,93 @@ struct get_result
     std::time_t time;
 };
 
+// One slot of a batched get. Spent or unallocated slots are not live
+// and have a zeroed point and time.
+struct get_many_result
+{
+    bool live;
+    bcs::ec_compressed point;
+    std::time_t time;
+};
+
+typedef std::vector<get_many_result> get_many_result_list;
+
+// One frame of a scan. Pass next back to continue, until it is
+// scan_complete.
+struct scan_frame
+{
+    output_index_type next;
+    output_index_list indexes;
+    std::vector<output_record> records;
+};
+
 class blockchain_client
 {
 public:
-    blockchain_client();
+    blockchain_client(
+        const std::string& endpoint = default_endpoints().blockchain_connect);
     ~blockchain_client();
 
     output_index_type put(const bcs::ec_compressed& point);
     get_result get(const output_index_type index);
 
-    void remove(const output_index_type index);
+    // False if the output was not unspent, leaving the chain unchanged.
+    bool remove(const output_index_type index);
     bool exists(const output_index_type index);
 
+    // Looks up every index in one round trip, all from the same commit.
+    get_many_result_list get_many(const output_index_list& indexes);
+    std::vector<bool> exists_many(const output_index_list& indexes);
+
+    boost::optional<output_index_type> find(const bcs::ec_compressed& point);
+
+    // Up to limit unspent outputs from the cursor on, in index order.
+    scan_frame scan(output_index_type cursor,
+        uint32_t limit = scan_max_records);
+    // Streams every unspent output in index order, a frame at a time.
+    // Outputs spent or created while the scan runs may be missed or
+    // included depending on where the cursor is.
+    void scan(live_record_handler handler,
+        uint32_t limit = scan_max_records);
+
     output_index_type count();
+    output_index_type live_count();
+
+    // Sum of the unspent commitments, or none if nothing is unspent.
+    boost::optional<bcs::ec_compressed> commitment_sum();
+
+    // Journal sync latencies on the server.
+    flush_stats journal_flush_stats();
+
+    // Unspent outputs created in [from, to), oldest first.
+    output_index_list time_range(uint32_t from, uint32_t to);
+    // Up to count unspent outputs, newest first.
+    output_index_list newest(uint32_t count);
+
+    // Checks every unspent point on the server.
+    verify_report verify();
+
+    // Writes a snapshot file of the unspent outputs into the server's
+    // snapshots directory. The name may not contain '/' or '..'.
+    bool export_snapshot(const std::string& name);
+
+    // Server metrics in the Prometheus text format.
+    std::string stats();
+
+    // Merkle root over every record slot on the server.
+    bcs::hash_digest state_root();
+    // Proof for the slot against the server's state root, to check with
+    // merkle_tree::verify(). None if the slot was never allocated.
+    boost::optional<merkle_proof> state_proof(const output_index_type index);
 
 private:
     void send_request(blockchain_server_command command, bcs::data_slice data);
     void send_request(blockchain_server_command command, uint32_t value);
+    void send_request(blockchain_server_command command,
+        const output_index_list& indexes);
 
     bcs::data_chunk receive_response();
+    output_index_list receive_indexes();
 
     zsock_t* socket_ = nullptr;
 };
@@ -1,9 +1,16 @@
 #ifndef DARK_BLOCKCHAIN_SERVER_HPP
 #define DARK_BLOCKCHAIN_SERVER_HPP
 
+#include <chrono>
 #include <bitcoin/system.hpp>
 #include <czmq.h>
 #include <dark/blockchain.hpp>
+#include <dark/blockchain_snapshot.hpp>
+#include <dark/chain_feed.hpp>
+#include <dark/chain_sequencer.hpp>
+#include <dark/endpoints.hpp>
+#include <dark/kernel_journal.hpp>
+#include <dark/metrics.hpp>
 
 namespace dark {
 
@@ -15,9 +22,33 @@ enum class blockchain_server_command
     get = 2,
     remove = 3,
     exists = 4,
-    count = 5
+    count = 5,
+    live_count = 6,
+    find = 7,
+    commitment_sum = 8,
+    flush_stats = 9,
+    time_range = 10,
+    newest = 11,
+    verify = 12,
+    export_snapshot = 13,
+    state_root = 14,
+    state_proof = 15,
+    get_many = 16,
+    exists_many = 17,
+    scan = 18,
+    stats = 19
 };
 
+// Each get_many record is [live:1][point:33][time:4]. Spent and
+// unallocated slots come back with live 0 and a zeroed point and time.
+constexpr size_t get_many_record_size = 1 + blockchain_record_size;
+
+// A scan request is [cursor:4][limit:4] and returns [next cursor:4]
+// then up to limit [index:4][point:33][time:4] records of unspent
+// outputs from the cursor on, as blockchain_snapshot::scan() finds
+// them. Each frame reads its own snapshot.
+constexpr size_t scan_record_size = 4 + blockchain_record_size;
+
 struct blockchain_server_request
 {
     blockchain_server_command command;
@@ -27,21 +58,69 @@ struct blockchain_server_request
 class blockchain_server
 {
 public:
-    blockchain_server();
+    // The shard count only applies when the chain is first created.
+    // Requests are served by a pool of workers, one per core by default,
+    // on every endpoint of the bind list. Every commit is journaled
+    // under kernels_directory, and snapshot files are only exported
+    // into snapshots_directory.
+    blockchain_server(size_t shards = 1,
+        record_layout layout = record_layout::classic, size_t workers = 0,
+        const std::string& bind = default_endpoints().blockchain_bind,
+        const std::string& kernels_directory = "kernels",
+        const std::string& snapshots_directory = "snapshots");
     ~blockchain_server();
 
     void start();
 
     dark::blockchain& chain();
+    // Every mutation of the chain goes through here.
+    chain_sequencer& sequencer();
 private:
-    blockchain_server_request receive();
-    void reply(const blockchain_server_request& request);
+    // Serves requests handed over by the front end until shutdown.
+    void run_worker();
+
+    bool receive(zsock_t* socket, blockchain_server_request& request);
+    void reply(zsock_t* socket, const blockchain_server_request& request);
+    // Appends an entry per batch of a commit to the kernel journal, so
+    // every published change can be re-derived, and syncs it under the
+    // chain's durability policy.
+    void journal_commit(const sequenced_batch_list& committed);
+    // Whether the entries appended since the last sync, holding this
+    // many removes and puts, are due to be synced.
+    bool kernels_due(size_t records);
+    // Creation time of the batch's puts, or now if it has none.
+    uint32_t commit_time(const sequenced_batch& committed) const;
+    // Samples the gauges and writes out every server metric.
+    std::string stats_text();
 
-    void respond(bcs::data_slice data);
-    void respond(uint32_t value);
+    void respond(zsock_t* socket, bcs::data_slice data);
+    void respond(zsock_t* socket, const output_record& record);
+    void respond(zsock_t* socket, uint32_t value);
+    void respond(zsock_t* socket, const output_index_list& indexes);
 
     dark::blockchain chain_;
-    zsock_t* socket_ = nullptr;
+    // Deltas of every commit, published from the sequencer's writer
+    chain_feed feed_;
+    // History of every commit, also written from the sequencer's writer
+    kernel_journal kernels_;
+    // What the writer has appended to kernels_ since it last synced
+    size_t unflushed_kernels_ = 0;
+    std::chrono::steady_clock::time_point kernels_flushed_;
+    size_t kernels_checkpoints_ = 0;
+    // Where export_snapshot writes, whatever the client asks
+    const std::string snapshots_directory_;
+    // Reads run concurrently on every worker, mutations are sequenced
+    chain_sequencer sequencer_;
+    const size_t workers_count_;
+    std::vector<std::thread> workers_;
+
+    // Latency by command number, the last one for unknown commands
+    std::vector<histogram*> command_time_;
+    metric_gauge& in_flight_;
+
+    // ROUTER for clients, DEALER for the workers
+    zsock_t* frontend_ = nullptr;
+    zsock_t* backend_ = nullptr;
 };
 
 } // namespace dark
@@ -0,0 +1,166 @@
+#ifndef DARK_BLOCKCHAIN_SNAPSHOT_HPP
+#define DARK_BLOCKCHAIN_SNAPSHOT_HPP
+
+#include <atomic>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <bitcoin/system.hpp>
+#include <dark/blockchain.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+// Creation and removal generation of every record, kept in memory.
+// Commits on different shards update disjoint entries while readers
+// look up visibility.
+class record_versions
+{
+public:
+    record_versions();
+    ~record_versions();
+
+    // non-copyable
+    record_versions(const record_versions&) = delete;
+
+    // Adds entries up to count. New entries are invisible to everyone.
+    void reserve(output_index_type count);
+
+    void created(const output_index_type index, generation_type generation);
+    // Keeps the prefix byte which the tombstone is about to overwrite.
+    void removed(const output_index_type index, generation_type generation,
+        uint8_t prefix);
+
+    bool visible(const output_index_type index,
+        generation_type generation) const;
+    uint8_t removed_prefix(const output_index_type index) const;
+
+private:
+    struct entry
+    {
+        std::atomic<generation_type> created;
+        std::atomic<generation_type> removed;
+        std::atomic<uint8_t> prefix;
+    };
+
+    static constexpr size_t chunk_bits = 16;
+    static constexpr size_t chunk_size = size_t(1) << chunk_bits;
+    typedef std::array<entry, chunk_size> chunk;
+
+    const entry& at(const output_index_type index) const;
+    entry& at(const output_index_type index);
+
+    // Chunks never move, so readers race only on the chunk pointer.
+    std::unique_ptr<std::atomic<chunk*>[]> chunks_;
+    std::mutex reserve_mutex_;
+    size_t chunks_count_ = 0;
+};
+
+// Snapshot files hold a 40 byte header
+//   [magic:4][version:4][shards:4][layout:4][count:4][live:4]
+//   [generation:8][checksum:8]
+// followed by fixed size [index:4][point:33][time:4] records for each
+// unspent output in index order. Slots below count which have no record
+// are free. The checksum is FNV-1a over the records.
+constexpr uint32_t snapshot_file_magic = 0x70616e73;
+constexpr uint32_t snapshot_file_version = 1;
+constexpr size_t snapshot_file_header_size = 40;
+constexpr size_t snapshot_file_record_size = 4 + blockchain_record_size;
+
+uint64_t snapshot_file_checksum(uint64_t checksum, const uint8_t* data,
+    size_t size);
+constexpr uint64_t snapshot_file_checksum_basis = 0xcbf29ce484222325;
+
+// Streams unspent records into a new snapshot file.
+class snapshot_file_writer
+{
+public:
+    snapshot_file_writer(const std::string& path);
+
+    // non-copyable
+    snapshot_file_writer(const snapshot_file_writer&) = delete;
+
+    // Records must be added in ascending index order.
+    void add(output_index_type index, const output_record& record);
+
+    // Writes the header and renames the file into place. Returns false
+    // if the file could not be written.
+    bool commit(size_t shards, record_layout layout, output_index_type count,
+        generation_type generation);
+
+private:
+    void write_block();
+
+    const std::string path_;
+    const std::string staged_path_;
+    std::ofstream file_;
+    bcs::data_chunk block_;
+    output_index_type live_ = 0;
+    uint64_t checksum_ = snapshot_file_checksum_basis;
+};
+
+// Most outputs one scan returns, also used when the limit is 0.
+constexpr uint32_t scan_max_records = 65536;
+// Next cursor once a scan has passed the end of the chain.
+constexpr output_index_type scan_complete =
+    std::numeric_limits<output_index_type>::max();
+
+// A consistent read only view of the chain as of one commit. Records
+// removed after the snapshot was taken stay readable, and slots are
+// not reused, until every older snapshot is released.
+class blockchain_snapshot
+{
+public:
+    ~blockchain_snapshot();
+
+    // non-copyable
+    blockchain_snapshot(const blockchain_snapshot&) = delete;
+
+    generation_type generation() const;
+
+    output_index_type count() const;
+    bool exists(const output_index_type index) const;
+    output_record get(const output_index_type index) const;
+
+    // Calls the handler for each output in [first, last) which was
+    // unspent at the snapshot's commit.
+    void for_each_live(output_index_type first, output_index_type last,
+        std::function<void (output_index_type, const output_record&)>
+            handler) const;
+    // Up to limit unspent outputs from the cursor on, in index order,
+    // walking windows of limit slots until they are found. Returns the
+    // cursor to continue from, or scan_complete past the end.
+    output_index_type scan(output_index_type cursor, uint32_t limit,
+        output_index_list& indexes,
+        std::vector<output_record>& records) const;
+
+    // Unspent outputs created in [from, to), oldest first, in
+    // O(log n + k) from the time index.
+    output_index_list created_between(uint32_t from, uint32_t to) const;
+    // Up to count unspent outputs, newest first.
+    output_index_list newest(size_t count) const;
+
+    // Writes the unspent outputs to a snapshot file, which
+    // blockchain::import_file() turns back into a chain. Returns false
+    // if the file could not be written.
+    bool write_file(const std::string& path) const;
+
+private:
+    friend class blockchain;
+
+    bool created_at(const output_index_type index,
+        const uint32_t time) const;
+
+    blockchain_snapshot(const blockchain& chain, generation_type generation,
+        output_index_type count);
+
+    const blockchain& chain_;
+    const generation_type generation_;
+    const output_index_type count_;
+};
+
+} // namespace dark
+
+#endif
+
@@ -0,0 +1,88 @@
+#ifndef DARK_CHAIN_FEED_HPP
+#define DARK_CHAIN_FEED_HPP
+
+#include <czmq.h>
+#include <bitcoin/system.hpp>
+#include <dark/blockchain.hpp>
+#include <dark/chain_sequencer.hpp>
+#include <dark/endpoints.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+struct chain_delta_output
+{
+    output_index_type index;
+    bcs::ec_compressed point;
+};
+
+typedef std::vector<chain_delta_output> chain_delta_output_list;
+
+// What one sequenced batch did to the chain. Sequences count up from 1
+// with every batch since the publisher started, so a subscriber can tell
+// when it missed some. Applying a delta only sets slots to spent or to
+// a point, so deltas that overlap a scan taken after subscribing can
+// be applied again safely.
+struct chain_delta
+{
+    uint64_t sequence = 0;
+    // Creation time of the added outputs
+    uint32_t time = 0;
+    output_index_list removed;
+    chain_delta_output_list added;
+
+    // [sequence:8][time:4][removed:4][added:4] then [index:4] per
+    // removed and [index:4][point:33] per added output.
+    bcs::data_chunk to_data() const;
+    bool from_data(bcs::data_slice data);
+};
+
+// Publishes a delta per committed batch on a PUB socket.
+class chain_feed
+{
+public:
+    chain_feed(const std::string& bind = default_endpoints().feed_bind);
+    ~chain_feed();
+
+    // non-copyable
+    chain_feed(const chain_feed&) = delete;
+
+    // Numbers the delta and sends it. Call from one thread at a time.
+    void publish(chain_delta& delta);
+    // Sends what a sequenced batch did, with the creation time of its
+    // outputs. Empty batches are skipped.
+    void publish(const sequenced_batch& committed, uint32_t time);
+
+private:
+    uint64_t sequence_ = 0;
+    zsock_t* socket_ = nullptr;
+};
+
+// Receives the deltas of a chain_feed in order.
+class chain_feed_subscriber
+{
+public:
+    chain_feed_subscriber(
+        const std::string& endpoint = default_endpoints().feed_connect);
+    ~chain_feed_subscriber();
+
+    // non-copyable
+    chain_feed_subscriber(const chain_feed_subscriber&) = delete;
+
+    // Blocks for the next delta. Returns false when interrupted.
+    bool receive(chain_delta& delta);
+    // Deltas skipped since subscribing, because the publisher dropped
+    // them or restarted. A mirror must be rebuilt once this grows.
+    uint64_t missed() const;
+
+private:
+    uint64_t last_sequence_ = 0;
+    uint64_t missed_ = 0;
+    zsock_t* socket_ = nullptr;
+};
+
+} // namespace dark
+
+#endif
+
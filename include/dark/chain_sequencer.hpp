@@ -0,0 +1,112 @@
+#ifndef DARK_CHAIN_SEQUENCER_HPP
+#define DARK_CHAIN_SEQUENCER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <boost/optional.hpp>
+#include <dark/blockchain.hpp>
+#include <dark/transaction.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+// A submitted batch once it is committed.
+struct sequenced_batch
+{
+    blockchain_batch batch;
+    // The transaction the batch applies, none for plain puts and removes
+    boost::optional<transaction_kernel> kernel;
+    // Allocated for the puts in staging order
+    output_index_list indexes;
+};
+
+typedef std::vector<sequenced_batch> sequenced_batch_list;
+
+// Receives the batches merged into each commit in submission order.
+typedef std::function<void (const sequenced_batch_list&)> commit_handler;
+
+// Owns the write side of a chain. Any thread may submit batches, which
+// are queued without locking and committed by a single writer thread in
+// submission order. Batches already waiting when the writer wakes are
+// merged into one commit.
+class chain_sequencer
+{
+public:
+    // Most batches merged into one commit.
+    static constexpr size_t max_group_size = 256;
+
+    chain_sequencer(dark::blockchain& chain);
+    // Commits everything already submitted before returning.
+    ~chain_sequencer();
+
+    // non-copyable
+    chain_sequencer(const chain_sequencer&) = delete;
+
+    // Queues the batch, with the kernel of the transaction it applies if
+    // any. The future holds the indexes allocated for its puts in
+    // staging order once it is committed, or none if it was rejected
+    // because a remove was no longer unspent by then.
+    std::future<boost::optional<output_index_list>> submit(
+        const blockchain_batch& batch,
+        const boost::optional<transaction_kernel>& kernel = boost::none);
+
+    // Submits and waits for the commit.
+    boost::optional<output_index_list> commit(const blockchain_batch& batch);
+    output_index_type put(const bcs::ec_compressed& point);
+    // Returns false if the output is not unspent.
+    bool remove(const output_index_type index);
+
+    // Called on the writer thread after every commit, in the order of
+    // the chain's journal and before any submitter sees the commit.
+    // Must be set before the first submission.
+    void set_commit_handler(commit_handler handler);
+
+    // Reads may go straight to the chain.
+    const dark::blockchain& chain() const;
+
+    // Submissions not yet committed.
+    size_t pending() const;
+
+private:
+    struct submission
+    {
+        blockchain_batch batch;
+        boost::optional<transaction_kernel> kernel;
+        std::promise<boost::optional<output_index_list>> done;
+        submission* next = nullptr;
+    };
+
+    // Drains the queue until stopped and empty.
+    void run_writer();
+    // Commits one submission of a rejected group on its own, then
+    // completes or rejects it.
+    void commit_alone(submission* item);
+    // Hands each submission in [first, end) its share of the indexes
+    // from their commit, passes them to the handler, then frees them.
+    void complete(submission* first, submission* end,
+        const output_index_list& indexes);
+
+    dark::blockchain& chain_;
+    commit_handler on_commit_;
+
+    // Newest submission first, pushed and taken with atomic swaps
+    std::atomic<submission*> head_{ nullptr };
+    std::atomic<size_t> pending_{ 0 };
+
+    // Only used to sleep while the queue is empty
+    std::mutex wake_mutex_;
+    std::condition_variable wake_condition_;
+    bool stopping_ = false;
+
+    std::thread writer_;
+};
+
+} // namespace dark
+
+#endif
+
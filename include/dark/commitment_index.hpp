@@ -0,0 +1,51 @@
+#ifndef DARK_COMMITMENT_INDEX_HPP
+#define DARK_COMMITMENT_INDEX_HPP
+
+#include <shared_mutex>
+#include <bitcoin/system.hpp>
+#include <bitcoin/database/memory/file_storage.hpp>
+#include <dark/blockchain.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+// Open addressing hash table from output commitments to their indexes,
+// kept in a memory mapped file. Only a 32 bit hash of each point is
+// stored, so lookups return candidate indexes which the caller must
+// check against the records. Lookups may run concurrently with one
+// writer.
+class commitment_index
+{
+public:
+    commitment_index(const std::string& filename);
+
+    // non-copyable
+    commitment_index(const commitment_index&) = delete;
+
+    // Erases every entry and picks a fresh hash seed.
+    void clear();
+
+    void insert(const bcs::ec_compressed& point, output_index_type index);
+    void erase(const bcs::ec_compressed& point, output_index_type index);
+
+    output_index_list candidates(const bcs::ec_compressed& point) const;
+
+    void flush();
+
+private:
+    uint32_t hash(const bcs::ec_compressed& point) const;
+    // Doubles the table and reinserts every entry from its stored hash.
+    void grow();
+
+    mutable bc::database::file_storage storage_;
+    mutable std::shared_timed_mutex mutex_;
+    uint64_t seed_;
+    uint32_t capacity_;
+    uint32_t size_;
+};
+
+} // namespace dark
+
+#endif
+
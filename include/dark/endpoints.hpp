@@ -0,0 +1,44 @@
+#ifndef DARK_ENDPOINTS_HPP
+#define DARK_ENDPOINTS_HPP
+
+#include <string>
+#include <czmq.h>
+
+namespace dark {
+
+// Where the servers listen and the clients connect. Servers bind every
+// endpoint of a comma separated list, so local tools can use ipc://
+// while remote ones use tcp://. Clients connect to a single endpoint.
+struct endpoint_config
+{
+    std::string blockchain_bind = "tcp://*:8887";
+    std::string blockchain_connect = "tcp://localhost:8887";
+
+    // Broadcasts pushed to the message server
+    std::string messages_bind = "tcp://*:8888";
+    std::string messages_connect = "tcp://localhost:8888";
+
+    // Messages the message server publishes
+    std::string publish_bind = "tcp://*:8889";
+    std::string publish_connect = "tcp://localhost:8889";
+
+    // Deltas of every chain commit
+    std::string feed_bind = "tcp://*:8890";
+    std::string feed_connect = "tcp://localhost:8890";
+};
+
+// Used by every server and client constructed without endpoints. Set
+// it up before creating any. When $XDG_RUNTIME_DIR is set, servers also
+// bind Unix domain sockets named darktech-<server> in that directory.
+// It belongs to the user alone, unlike /tmp where another user could
+// take the socket path first. Clients still connect over tcp unless
+// given an ipc:// endpoint, such as through the --*-endpoint options.
+endpoint_config& default_endpoints();
+
+// Binds each endpoint of the list. Returns false if any failed.
+bool bind_endpoints(zsock_t* socket, const std::string& endpoints);
+
+} // namespace dark
+
+#endif
+
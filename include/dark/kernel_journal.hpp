@@ -0,0 +1,105 @@
+#ifndef DARK_KERNEL_JOURNAL_HPP
+#define DARK_KERNEL_JOURNAL_HPP
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <boost/optional.hpp>
+#include <bitcoin/system.hpp>
+#include <bitcoin/database/memory/file_storage.hpp>
+#include <dark/blockchain.hpp>
+#include <dark/transaction.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+struct kernel_output
+{
+    output_index_type index;
+    bcs::ec_compressed point;
+};
+
+typedef std::vector<kernel_output> kernel_output_list;
+
+// One sequenced change to the chain: what it did, and the kernel of the
+// transaction it applied. Plain puts and removes have no kernel.
+struct kernel_entry
+{
+    uint64_t sequence = 0;
+    // Creation time of the added outputs
+    uint32_t time = 0;
+    boost::optional<transaction_kernel> kernel;
+    output_index_list removed;
+    kernel_output_list added;
+};
+
+// Return false to stop.
+typedef std::function<bool (const kernel_entry&)> kernel_entry_handler;
+
+// Append only history of every change to the chain, split over segment
+// files with an index from sequence to position. Unlike the chain's own
+// journal it is never truncated, so the chain can be re-derived and its
+// kernels re-verified from the start.
+class kernel_journal
+{
+public:
+    static constexpr size_t default_segment_size = 64 * 1024 * 1024;
+
+    // Opens or creates the journal, dropping any torn entry at the end.
+    kernel_journal(const std::string& directory,
+        size_t segment_size = default_segment_size);
+    ~kernel_journal();
+
+    // non-copyable
+    kernel_journal(const kernel_journal&) = delete;
+
+    // Assigns the entry the next sequence and appends it.
+    void append(kernel_entry& entry);
+    // Syncs every entry appended so far.
+    void flush();
+
+    // Number of entries, which is also the next sequence.
+    uint64_t count() const;
+
+    bool read(uint64_t sequence, kernel_entry& entry) const;
+    // Streams the entries from first on in order, up to the count when
+    // called. The handler must not append.
+    void for_each(uint64_t first, kernel_entry_handler handler) const;
+
+    // Replays the journal into a new chain at prefix, checking every
+    // kernel's signature and excess on all cores (or threads) as the
+    // segments are read. Entries without a kernel are applied as is.
+    // Shards must match the chain that journaled the entries. Returns
+    // false if prefix exists or an entry does not verify or fit shards.
+    static bool rebuild(const std::string& directory, const char* prefix,
+        size_t shards = 1, record_layout layout = record_layout::classic,
+        size_t threads = 0);
+
+private:
+    typedef std::shared_ptr<bc::database::file_storage> storage_ptr;
+
+    std::string segment_path(uint32_t segment) const;
+    storage_ptr open_segment(uint32_t segment) const;
+    // Shares the last segment with the writer rather than mapping it
+    // twice. Other segments are never written again.
+    storage_ptr read_segment(uint32_t segment) const;
+    // Adds index entries for the frames of segment from sequence on.
+    void index_segment(uint32_t segment, uint64_t sequence);
+    // Closes the last segment and starts the next at the current count.
+    void roll_segment();
+
+    const std::string directory_;
+    const size_t segment_size_;
+
+    mutable std::mutex mutex_;
+    uint32_t segment_ = 0;
+    storage_ptr segment_storage_;
+    size_t segment_end_ = 0;
+    uint64_t count_ = 0;
+    mutable bc::database::file_storage index_storage_;
+};
+
+} // namespace dark
+
+#endif
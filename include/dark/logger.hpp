@@ -0,0 +1,184 @@
+#ifndef DARK_LOGGER_HPP
+#define DARK_LOGGER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <bitcoin/system.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+enum class log_level
+{
+    debug = 0,
+    info = 1,
+    warning = 2,
+    error = 3
+};
+
+// Leveled logger for the servers. Callers copy a format literal and raw
+// arguments into a lock-free ring buffer, and a background thread does
+// the formatting and writing. Lines are dropped rather than blocking
+// when the ring is full. Formats take %u for the next number, %x for
+// the bytes argument in hex and %s for it as text.
+class logger
+{
+public:
+    // Numbers and bytes one line can carry.
+    static constexpr size_t max_numbers = 4;
+    static constexpr size_t max_bytes = 128;
+
+    // The capacity is rounded up to a power of two.
+    logger(size_t capacity = 8192);
+    // Writes out every queued line first.
+    ~logger();
+
+    // non-copyable
+    logger(const logger&) = delete;
+
+    // Lines below the level are discarded. Defaults to info.
+    void set_level(log_level level);
+    // Keeps only one in every debug lines. Defaults to 1, keeping all.
+    void set_sample_rate(uint32_t every);
+
+    bool enabled(log_level level) const;
+
+    template <typename... Args>
+    void debug(const char* format, const Args&... args)
+    {
+        if (!enabled(log_level::debug))
+            return;
+        const auto every = sample_rate_.load(std::memory_order_relaxed);
+        if (every > 1 &&
+            sampled_.fetch_add(1, std::memory_order_relaxed) % every != 0)
+            return;
+        write(log_level::debug, format, args...);
+    }
+    template <typename... Args>
+    void info(const char* format, const Args&... args)
+    {
+        if (enabled(log_level::info))
+            write(log_level::info, format, args...);
+    }
+    template <typename... Args>
+    void warning(const char* format, const Args&... args)
+    {
+        if (enabled(log_level::warning))
+            write(log_level::warning, format, args...);
+    }
+    template <typename... Args>
+    void error(const char* format, const Args&... args)
+    {
+        if (enabled(log_level::error))
+            write(log_level::error, format, args...);
+    }
+
+    // Lines lost to a full ring since the logger was created.
+    uint64_t dropped() const;
+
+private:
+    // The format must be a literal, since only its address is kept.
+    struct entry
+    {
+        log_level level;
+        const char* format;
+        uint8_t numbers_count;
+        uint64_t numbers[max_numbers];
+        uint8_t bytes_size;
+        uint8_t bytes[max_bytes];
+    };
+
+    struct slot
+    {
+        // Ring position this slot is free for, plus one once written
+        std::atomic<size_t> sequence;
+        entry value;
+    };
+
+    template <typename... Args>
+    void write(log_level level, const char* format, const Args&... args)
+    {
+        entry line;
+        line.level = level;
+        line.format = format;
+        line.numbers_count = 0;
+        line.bytes_size = 0;
+        capture(line, args...);
+        push(line);
+    }
+
+    static void capture(entry&)
+    {
+    }
+    template <typename First, typename... Rest>
+    static void capture(entry& line, const First& first,
+        const Rest&... rest)
+    {
+        capture_one(line, first);
+        capture(line, rest...);
+    }
+
+    template <typename Number, typename std::enable_if<
+        std::is_arithmetic<Number>::value, int>::type = 0>
+    static void capture_one(entry& line, const Number value)
+    {
+        if (line.numbers_count < max_numbers)
+            line.numbers[line.numbers_count++] = static_cast<uint64_t>(value);
+    }
+    template <size_t Size>
+    static void capture_one(entry& line, const bcs::byte_array<Size>& value)
+    {
+        capture_bytes(line, value.data(), value.size());
+    }
+    static void capture_one(entry& line, const std::string& value)
+    {
+        capture_bytes(line, reinterpret_cast<const uint8_t*>(value.data()),
+            value.size());
+    }
+    static void capture_one(entry& line, const char* value)
+    {
+        capture_bytes(line, reinterpret_cast<const uint8_t*>(value),
+            std::strlen(value));
+    }
+    static void capture_bytes(entry& line, const uint8_t* data, size_t size);
+
+    // Claims a slot for the line, or counts it dropped if none is free.
+    void push(const entry& line);
+    // Writes out everything queued and returns how many lines.
+    size_t drain();
+    void run_writer();
+
+    static std::string format(const entry& line);
+
+    std::atomic<log_level> level_{ log_level::info };
+    std::atomic<uint32_t> sample_rate_{ 1 };
+    std::atomic<uint32_t> sampled_{ 0 };
+    std::atomic<uint64_t> dropped_{ 0 };
+
+    const size_t mask_;
+    std::unique_ptr<slot[]> slots_;
+    std::atomic<size_t> tail_{ 0 };
+    // Only touched by the writer thread
+    size_t head_ = 0;
+
+    // The writer polls, so logging never takes a lock
+    std::mutex stop_mutex_;
+    std::condition_variable stop_condition_;
+    bool stopping_ = false;
+    std::thread writer_;
+};
+
+// Shared by the servers of this process.
+logger& server_log();
+
+} // namespace dark
+
+#endif
+
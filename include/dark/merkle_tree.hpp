@@ -0,0 +1,67 @@
+#ifndef DARK_MERKLE_TREE_HPP
+#define DARK_MERKLE_TREE_HPP
+
+#include <bitcoin/system.hpp>
+#include <dark/blockchain.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+// Binary hash tree of fixed depth over every 32 bit output index, so
+// the root does not depend on how many slots are allocated. Leaves are
+//   sha256(0x00 [index:4][point:33][time:4])
+// for unspent records and null_hash for spent or free slots. Interior
+// nodes are sha256(0x01 [left:32][right:32]). Only the nodes over
+// allocated slots are kept in memory. Everything to their right hashes
+// as empty subtrees, so an update rehashes only the paths above changed
+// leaves.
+class merkle_tree
+{
+public:
+    // Siblings in every proof
+    static constexpr size_t depth = 32;
+
+    static bcs::hash_digest leaf_hash(const output_index_type index,
+        const output_record& record);
+
+    // Whether the proof leads from the leaf to its root.
+    static bool verify(const merkle_proof& proof,
+        const bcs::hash_digest& leaf);
+
+    // Sets the leaves then rehashes each of their ancestors once.
+    // The tree grows to cover the highest index.
+    void update(const merkle_leaf_list& leaves);
+    // Grows the tree with empty slots up to size.
+    void resize(output_index_type size);
+
+    bcs::hash_digest root() const;
+    output_index_type size() const;
+
+    // The index must be below size().
+    merkle_proof prove(const output_index_type index) const;
+
+    // Writes every kept node to the file, tagged with the sequence.
+    // Returns false if the file could not be written.
+    bool save(const std::string& path, uint64_t sequence) const;
+    // Replaces the tree with the one saved in the file, if the file is
+    // intact and was saved with the sequence.
+    bool load(const std::string& path, uint64_t sequence);
+
+private:
+    // Root of a subtree of empty slots at level.
+    static const bcs::hash_digest& empty_hash(size_t level);
+
+    // Empty past the kept nodes of the level
+    const bcs::hash_digest& node(size_t level, uint64_t position) const;
+
+    output_index_type size_ = 0;
+    // Leaves first, then each level of parents up to the root. Each
+    // covers the slots [0, size).
+    std::vector<bcs::hash_list> levels_ =
+        std::vector<bcs::hash_list>(depth + 1);
+};
+
+} // namespace dark
+
+#endif
@@ -5,19 +5,25 @@
 #include <QString>
 #include <QThread>
 #include <czmq.h>
+#include <dark/endpoints.hpp>
 
 namespace dark {
 
 class message_client
 {
 public:
-    message_client();
+    message_client(
+        const std::string& send_endpoint = default_endpoints().messages_connect,
+        const std::string& receive_endpoint =
+            default_endpoints().publish_connect);
     ~message_client();
 
     void send(const std::string& message);
 
     std::string receive();
 private:
+    const std::string send_endpoint_;
+    const std::string receive_endpoint_;
     zsock_t* sender_socket_ = nullptr;
     zsock_t* receiver_socket_ = nullptr;
 };
@@ -1,9 +1,16 @@
 #ifndef DARK_MESSAGE_SERVER_HPP
 #define DARK_MESSAGE_SERVER_HPP
 
+#include <array>
+#include <atomic>
 #include <czmq.h>
 #include <nlohmann/json.hpp>
 #include <dark/blockchain.hpp>
+#include <dark/chain_sequencer.hpp>
+#include <dark/endpoints.hpp>
+#include <dark/metrics.hpp>
+#include <dark/point_cache.hpp>
+#include <dark/transaction.hpp>
 
 namespace dark {
 
@@ -12,14 +19,73 @@ using json = nlohmann::json;
 class message_server
 {
 public:
-    message_server(dark::blockchain& chain);
+    // Accepted transactions are committed through the sequencer, which
+    // hands their kernels on to be journaled. The chain is used in
+    // process, so only clients go through sockets.
+    message_server(chain_sequencer& sequencer,
+        const std::string& receive_bind = default_endpoints().messages_bind,
+        const std::string& publish_bind = default_endpoints().publish_bind);
     ~message_server();
+    // Serves broadcasts until stop() is called from another thread.
     void start();
-    void accept_if_valid(json response);
+    void stop();
+    // Validates a broadcast and stages its removes and puts in the batch.
+    bool accept_if_valid(json response, blockchain_batch& batch);
 private:
+    // Most broadcasts drained from the socket into one group commit.
+    static constexpr size_t max_group_size = 64;
+
+    struct accepted_transaction
+    {
+        json response;
+        transaction_kernel kernel;
+        output_index_list removed;
+        bcs::point_list added;
+        // Decompressed forms of added, for the input cache
+        pubkey_list added_keys;
+    };
+    typedef std::vector<accepted_transaction> accepted_list;
+
+    enum class reject_reason
+    {
+        duplicate_output,
+        invalid_output,
+        invalid_input,
+        excess,
+        signature,
+        rangeproof,
+        // An input was spent by another commit after validation
+        spent_input
+    };
+
+    // Logs and counts a rejected broadcast. Always returns false.
+    bool reject(reject_reason reason);
+
+    // Commits each accepted transaction with its kernel and publishes
+    // a final message per committed transaction.
+    void finalize();
+
+    accepted_list accepted_;
+    // Decompressed commitments of recently created outputs
+    point_cache input_points_;
     zsock_t* receiver_socket_ = nullptr;
     zsock_t* publish_socket_ = nullptr;
-    dark::blockchain& chain_;
+    std::atomic<bool> stopping_{ false };
+    chain_sequencer& sequencer_;
+    const dark::blockchain& chain_;
+
+    // Time spent in each stage of validation, and in commits
+    histogram& outputs_time_;
+    histogram& inputs_time_;
+    histogram& excess_time_;
+    histogram& signature_time_;
+    histogram& rangeproof_time_;
+    histogram& commit_time_;
+    // Broadcasts received per group commit
+    histogram& group_size_;
+    metric_counter& accepted_count_;
+    // By reject_reason
+    std::array<metric_counter*, 7> rejected_count_;
 };
 
 } // namespace dark
@@ -0,0 +1,88 @@
+#ifndef DARK_METRICS_HPP
+#define DARK_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace dark {
+
+// Log-linear histogram in the style of HdrHistogram. Values below 16
+// are exact, above that every power of two is split into 8 buckets,
+// so quantiles are within 12.5%. Recording is a few relaxed atomic
+// adds and never locks.
+class histogram
+{
+public:
+    static constexpr size_t buckets_count = 16 + 60 * 8;
+
+    void record(uint64_t value);
+
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t max() const;
+    // Upper bound of the bucket holding the quantile, 0 if empty.
+    uint64_t quantile(double fraction) const;
+
+private:
+    static size_t bucket_of(uint64_t value);
+    static uint64_t bucket_upper(size_t bucket);
+
+    std::array<std::atomic<uint64_t>, buckets_count> buckets_{};
+    std::atomic<uint64_t> count_{ 0 };
+    std::atomic<uint64_t> sum_{ 0 };
+    std::atomic<uint64_t> max_{ 0 };
+};
+
+// Records the microseconds from construction to destruction.
+class scoped_timer
+{
+public:
+    scoped_timer(histogram& target);
+    ~scoped_timer();
+
+private:
+    histogram& target_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+typedef std::atomic<uint64_t> metric_counter;
+typedef std::atomic<int64_t> metric_gauge;
+
+// Named histograms, counters and gauges, written out in the Prometheus
+// text format. Metrics are created on first use and never removed, so
+// callers look them up once and keep the reference.
+class metrics
+{
+public:
+    // Labels are the inside of the braces, e.g. command="get".
+    histogram& histogram_for(const std::string& name,
+        const std::string& labels = "");
+    metric_counter& counter_for(const std::string& name,
+        const std::string& labels = "");
+    metric_gauge& gauge_for(const std::string& name,
+        const std::string& labels = "");
+
+    // Histograms as count, sum, max and quantile lines, sorted by name.
+    std::string text() const;
+
+private:
+    typedef std::pair<std::string, std::string> metric_key;
+
+    mutable std::mutex mutex_;
+    std::map<metric_key, std::unique_ptr<histogram>> histograms_;
+    std::map<metric_key, std::unique_ptr<metric_counter>> counters_;
+    std::map<metric_key, std::unique_ptr<metric_gauge>> gauges_;
+};
+
+// Shared by the servers of this process.
+metrics& server_metrics();
+
+} // namespace dark
+
+#endif
+
@@ -0,0 +1,75 @@
+#ifndef DARK_POINT_CACHE_HPP
+#define DARK_POINT_CACHE_HPP
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <secp256k1.h>
+#include <bitcoin/system.hpp>
+#include <dark/blockchain.hpp>
+
+namespace dark {
+
+namespace bcs = bc::system;
+
+typedef std::vector<secp256k1_pubkey> pubkey_list;
+
+// Decompresses a point. Returns false if it is not on the curve.
+bool parse_point(secp256k1_pubkey& out, const bcs::ec_compressed& point);
+
+// Computes sum(added) - sum(removed) with a single conversion back to
+// compressed form. Returns false if the result is the point at infinity.
+bool sum_points(bcs::ec_compressed& out, const pubkey_list& added,
+    const pubkey_list& removed);
+
+// Bounded cache of decompressed output commitments by index, so
+// spending an output does not repeat the square root done when it was
+// created. Entries remember their compressed point and only hit when
+// it matches, so a stale entry for a reused slot is never returned.
+class point_cache
+{
+public:
+    point_cache(size_t capacity = 65536);
+
+    // non-copyable
+    point_cache(const point_cache&) = delete;
+
+    // Returns the decompressed point, parsing and caching it on a miss.
+    bool load(secp256k1_pubkey& out, output_index_type index,
+        const bcs::ec_compressed& point);
+
+    // Caches a point which was already decompressed elsewhere.
+    void insert(output_index_type index, const bcs::ec_compressed& point,
+        const secp256k1_pubkey& key);
+    void erase(output_index_type index);
+
+    size_t hits() const;
+    size_t misses() const;
+
+private:
+    struct entry
+    {
+        output_index_type index;
+        bcs::ec_compressed point;
+        secp256k1_pubkey key;
+    };
+    typedef std::list<entry> entry_list;
+
+    // Caller must hold mutex_.
+    void insert_locked(output_index_type index,
+        const bcs::ec_compressed& point, const secp256k1_pubkey& key);
+
+    const size_t capacity_;
+
+    // Most recently used at the front
+    entry_list entries_;
+    std::unordered_map<output_index_type, entry_list::iterator> lookup_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    mutable std::mutex mutex_;
+};
+
+} // namespace dark
+
+#endif
+
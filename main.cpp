@@ -9,8 +9,13 @@
 #include <nlohmann/json.hpp>
 #include <dark/blockchain_client.hpp>
 #include <dark/blockchain_server.hpp>
+#include <dark/chain_feed.hpp>
+#include <dark/endpoints.hpp>
+#include <dark/kernel_journal.hpp>
+#include <dark/logger.hpp>
 #include <dark/message_client.hpp>
 #include <dark/message_server.hpp>
+#include <dark/point_cache.hpp>
 #include <dark/transaction.hpp>
 #include <dark/utility.hpp>
 #include <dark/wallet.hpp>
@@ -25,6 +30,9 @@ typedef std::function<void ()> update_balance_callback;
 
 keys_map_type keys_map;
 
+// Decompressed input commitments seen by receive_money()
+dark::point_cache input_points;
+
 bool is_bit_set(uint64_t value, size_t i)
 {
     const uint64_t value_2i = std::pow(2, i);
@@ -553,27 +561,30 @@ void receive_money(dark::wallet& wallet, dark::message_client& client,
     }
 
     // verify outputs and inputs
-    bcs::ec_point re_excess;
-    bool is_init = false;
+    dark::pubkey_list output_keys, input_keys;
     for (const auto& output: tx.outputs)
     {
-        if (!is_init)
-        {
-            is_init = true;
-            re_excess = output.output;
-        }
-        else
-            re_excess += output.output;
+        secp256k1_pubkey key;
+        bool rc = dark::parse_point(key, output.output.point());
+        BITCOIN_ASSERT(rc);
+        output_keys.push_back(key);
     }
+    // Every input in one round trip
     dark::blockchain_client chain;
-    for (const auto input: tx.inputs)
+    const auto inputs = chain.get_many(tx.inputs);
+    for (size_t i = 0; i < tx.inputs.size(); ++i)
     {
-        BITCOIN_ASSERT(input < chain.count());
-        BITCOIN_ASSERT(chain.exists(input));
-        auto result = chain.get(input);
-        re_excess -= result.point;
+        const auto input = tx.inputs[i];
+        BITCOIN_ASSERT(inputs[i].live);
+        secp256k1_pubkey key;
+        bool rc = input_points.load(key, input, inputs[i].point);
+        BITCOIN_ASSERT(rc);
+        input_keys.push_back(key);
     }
-    BITCOIN_ASSERT(tx.kernel.excess == re_excess);
+    bcs::ec_compressed re_excess;
+    rc = dark::sum_points(re_excess, output_keys, input_keys);
+    BITCOIN_ASSERT(rc);
+    BITCOIN_ASSERT(tx.kernel.excess.point() == re_excess);
 
     // connect to messenging service
     auto final_receive = 
@@ -607,6 +618,45 @@ void show_help()
     std::cout << "  -d, --delete INDEX\tdelete block" << std::endl;
     std::cout << "  --c1 NUM\tcalculate point #1" << std::endl;
     std::cout << "  --c2 NUM\tcalculate point #2" << std::endl;
+    std::cout << "  --server\trun blockchain server" << std::endl;
+    std::cout << "  --shards NUM\toutput shards for a new blockchain"
+        << std::endl;
+    std::cout << "  --workers NUM\tblockchain server threads" << std::endl;
+    std::cout << "  --log-level LEVEL\tdebug, info, warning or error"
+        << std::endl;
+    std::cout << "  --log-sample NUM\tlog one in NUM debug lines"
+        << std::endl;
+    std::cout << "  --durability MODE\tnone, group or commit journal sync"
+        << std::endl;
+    std::cout << "  --flush-ms NUM\tgroup sync interval" << std::endl;
+    std::cout << "  --flush-records NUM\tgroup sync record limit"
+        << std::endl;
+    std::cout << "  --growth-chunk NUM\tgrow outputs by NUM records"
+        << std::endl;
+    std::cout << "  --growth-percent NUM\tgrow outputs by NUM percent"
+        << std::endl;
+    std::cout << "  --dense\tuse the dense layout for a new blockchain"
+        << std::endl;
+    std::cout << "  --convert-dense\tconvert the blockchain to the dense "
+        "layout" << std::endl;
+    std::cout << "  --verify\tcheck every unspent point before serving"
+        << std::endl;
+    std::cout << "  --export NAME\twrite a snapshot file into the server's "
+        "snapshots directory" << std::endl;
+    std::cout << "  --stats\tprint the server metrics" << std::endl;
+    std::cout << "  --feed\tprint chain changes as they happen" << std::endl;
+    std::cout << "  --blockchain-endpoint LIST\tblockchain server "
+        "endpoints" << std::endl;
+    std::cout << "  --messages-endpoint LIST\tbroadcast endpoints"
+        << std::endl;
+    std::cout << "  --publish-endpoint LIST\tpublished message endpoints"
+        << std::endl;
+    std::cout << "  --feed-endpoint LIST\tchain change feed endpoints"
+        << std::endl;
+    std::cout << "  --import PATH\tcreate the blockchain from a snapshot"
+        << std::endl;
+    std::cout << "  --replay-kernels DIR\tcreate the blockchain from a "
+        "kernel journal" << std::endl;
 }
 
 bool write_point(const std::string& point_string)
@@ -629,16 +679,14 @@ void read_all()
 {
     //dark::blockchain chain;
     dark::blockchain_client chain;
-    const auto chain_count = chain.count();
-    for (size_t i = 0; i < chain_count; ++i)
+    chain.scan([](dark::output_index_type i,
+        const dark::output_record& result)
     {
-        if (!chain.exists(i))
-            continue;
-        auto result = chain.get(i);
+        const std::time_t time = result.time;
         std::cout << "#" << i << " "
             << bcs::encode_base16(result.point) << " "
-            << std::asctime(std::localtime(&result.time)) << std::endl;
-    }
+            << std::asctime(std::localtime(&time)) << std::endl;
+    });
 }
 
 void set_commit_table(QTableWidget* table)
@@ -648,16 +696,14 @@ void set_commit_table(QTableWidget* table)
         QHeaderView::ResizeToContents);
     table->setRowCount(0);
 
+    // Only unspent outputs come back, a large frame at a time
     dark::blockchain_client chain;
-    const auto chain_count = chain.count();
-    for (size_t i = 0; i < chain_count; ++i)
+    chain.scan([table](dark::output_index_type i,
+        const dark::output_record& result)
     {
-        if (!chain.exists(i))
-            continue;
         const size_t index = table->rowCount();
         table->setRowCount(index + 1);
 
-        auto result = chain.get(i);
         QString point_string = QString::fromStdString(
             bcs::encode_base16(result.point));
         QTableWidgetItem *point_item = new QTableWidgetItem(point_string);
@@ -668,10 +714,11 @@ void set_commit_table(QTableWidget* table)
             time.toString("HH:mm ddd d MMM yy"));
         table->setItem(index, 1, time_item);
 
+        const std::time_t seconds = result.time;
         std::cout << "#" << i << " "
             << bcs::encode_base16(result.point) << " "
-            << std::asctime(std::localtime(&result.time)) << std::endl;
-    }
+            << std::asctime(std::localtime(&seconds)) << std::endl;
+    });
 }
 
 bool remove_point(size_t index)
@@ -688,7 +735,11 @@ bool remove_point(size_t index)
         std::cerr << "Error already deleted. Doing nothing." << std::endl;
         return false;
     }
-    chain.remove(index);
+    if (!chain.remove(index))
+    {
+        std::cerr << "Error removing index, already spent." << std::endl;
+        return false;
+    }
     return true;
 }
 
@@ -745,6 +796,43 @@ int main(int argc, char** argv)
         ("b,balance", "Show balance")
         ("a,add", "Add fake output", cxxopts::value<uint64_t>())
         ("server", "Run blockchain server")
+        ("shards", "Output shards for a new blockchain",
+            cxxopts::value<size_t>())
+        ("workers", "Blockchain server threads, one per core by default",
+            cxxopts::value<size_t>())
+        ("log-level", "Server log level: debug, info, warning or error",
+            cxxopts::value<std::string>())
+        ("log-sample", "Log one in every NUM server debug lines",
+            cxxopts::value<uint32_t>())
+        ("durability", "Journal sync: none, group or commit",
+            cxxopts::value<std::string>())
+        ("flush-ms", "Group sync interval", cxxopts::value<uint32_t>())
+        ("flush-records", "Group sync record limit",
+            cxxopts::value<uint32_t>())
+        ("growth-chunk", "Grow outputs by a fixed number of records",
+            cxxopts::value<uint32_t>())
+        ("growth-percent", "Grow outputs by a percentage",
+            cxxopts::value<uint32_t>())
+        ("dense", "Use the dense layout for a new blockchain")
+        ("convert-dense", "Convert the blockchain to the dense layout")
+        ("verify", "Check every unspent point before serving")
+        ("export", "Write a snapshot file named NAME into the running "
+            "server's snapshots directory",
+            cxxopts::value<std::string>())
+        ("stats", "Print the running server's metrics")
+        ("feed", "Print the server's chain changes as they happen")
+        ("blockchain-endpoint", "Blockchain server endpoints to bind, or "
+            "the one to connect to", cxxopts::value<std::string>())
+        ("messages-endpoint", "Message server broadcast endpoints",
+            cxxopts::value<std::string>())
+        ("publish-endpoint", "Message server publish endpoints",
+            cxxopts::value<std::string>())
+        ("feed-endpoint", "Chain change feed endpoints",
+            cxxopts::value<std::string>())
+        ("import", "Create the blockchain from a snapshot file",
+            cxxopts::value<std::string>())
+        ("replay-kernels", "Create the blockchain from a kernel journal",
+            cxxopts::value<std::string>())
     ;
     auto result = options.parse(argc, argv);
 
@@ -756,6 +844,21 @@ int main(int argc, char** argv)
     if (result.count("username"))
         username = result["username"].as<std::string>();
 
+    // A server binds the whole list, clients connect to the endpoint
+    auto& endpoints = dark::default_endpoints();
+    if (result.count("blockchain-endpoint"))
+        endpoints.blockchain_bind = endpoints.blockchain_connect =
+            result["blockchain-endpoint"].as<std::string>();
+    if (result.count("messages-endpoint"))
+        endpoints.messages_bind = endpoints.messages_connect =
+            result["messages-endpoint"].as<std::string>();
+    if (result.count("publish-endpoint"))
+        endpoints.publish_bind = endpoints.publish_connect =
+            result["publish-endpoint"].as<std::string>();
+    if (result.count("feed-endpoint"))
+        endpoints.feed_bind = endpoints.feed_connect =
+            result["feed-endpoint"].as<std::string>();
+
     gui_logger_buffer buffer(*std::cout.rdbuf());
     std::ostream stream(&buffer);
 
@@ -807,19 +910,159 @@ int main(int argc, char** argv)
         add_output(wallet, value);
         return 0;
     }
+    else if (result.count("export"))
+    {
+        dark::blockchain_client client;
+        if (!client.export_snapshot(result["export"].as<std::string>()))
+        {
+            std::cerr << "Error writing snapshot" << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+    else if (result.count("feed"))
+    {
+        dark::chain_feed_subscriber feed;
+        dark::chain_delta delta;
+        while (feed.receive(delta))
+        {
+            std::cout << "#" << delta.sequence << " removed "
+                << delta.removed.size() << " added " << delta.added.size()
+                << " missed " << feed.missed() << std::endl;
+            for (const auto index: delta.removed)
+                std::cout << "  -" << index << std::endl;
+            for (const auto& output: delta.added)
+                std::cout << "  +" << output.index << " "
+                    << bcs::encode_base16(output.point) << std::endl;
+        }
+        return 0;
+    }
+    else if (result.count("stats"))
+    {
+        dark::blockchain_client client;
+        std::cout << client.stats();
+        return 0;
+    }
+    else if (result.count("import"))
+    {
+        const auto path = result["import"].as<std::string>();
+        return dark::blockchain::import_file(path.c_str(), "blockchain") ?
+            0 : -1;
+    }
+    else if (result.count("replay-kernels"))
+    {
+        size_t shards = 1;
+        if (result.count("shards"))
+            shards = std::max<size_t>(result["shards"].as<size_t>(), 1);
+        const auto layout = result.count("dense") ?
+            dark::record_layout::dense : dark::record_layout::classic;
+        return dark::kernel_journal::rebuild(
+            result["replay-kernels"].as<std::string>(), "blockchain",
+            shards, layout) ? 0 : -1;
+    }
+    else if (result.count("convert-dense"))
+    {
+        if (!dark::blockchain::convert_to_dense("blockchain"))
+        {
+            std::cerr << "Error blockchain is already dense" << std::endl;
+            return -1;
+        }
+        return 0;
+    }
     else if (result.count("server"))
     {
-        dark::blockchain_server server;
+        size_t shards = 1;
+        if (result.count("shards"))
+            shards = result["shards"].as<size_t>();
+        if (shards == 0)
+        {
+            std::cerr << "Error shards must be at least 1" << std::endl;
+            return -1;
+        }
+
+        dark::durability_policy durability;
+        if (result.count("durability"))
+        {
+            const auto mode = result["durability"].as<std::string>();
+            if (mode == "none")
+                durability.mode = dark::durability_mode::none;
+            else if (mode == "group")
+                durability.mode = dark::durability_mode::group;
+            else if (mode == "commit")
+                durability.mode = dark::durability_mode::commit;
+            else
+            {
+                std::cerr << "Error unknown durability mode" << std::endl;
+                return -1;
+            }
+        }
+        if (result.count("flush-ms"))
+            durability.interval_ms = result["flush-ms"].as<uint32_t>();
+        if (result.count("flush-records"))
+            durability.records = result["flush-records"].as<uint32_t>();
+
+        auto& log = dark::server_log();
+        if (result.count("log-level"))
+        {
+            const auto level = result["log-level"].as<std::string>();
+            if (level == "debug")
+                log.set_level(dark::log_level::debug);
+            else if (level == "info")
+                log.set_level(dark::log_level::info);
+            else if (level == "warning")
+                log.set_level(dark::log_level::warning);
+            else if (level == "error")
+                log.set_level(dark::log_level::error);
+            else
+            {
+                std::cerr << "Error unknown log level" << std::endl;
+                return -1;
+            }
+        }
+        if (result.count("log-sample"))
+            log.set_sample_rate(result["log-sample"].as<uint32_t>());
+
+        const auto layout = result.count("dense") ?
+            dark::record_layout::dense : dark::record_layout::classic;
+        size_t workers = 0;
+        if (result.count("workers"))
+            workers = result["workers"].as<size_t>();
+        dark::blockchain_server server(shards, layout, workers);
         auto& chain = server.chain();
+        chain.set_durability(durability);
 
-        std::thread thread([&chain]
+        dark::growth_policy growth;
+        if (result.count("growth-chunk"))
         {
-            dark::message_server server(chain);
-            server.start();
-        });
-        thread.detach();
+            growth.mode = dark::growth_mode::fixed;
+            growth.chunk_records = result["growth-chunk"].as<uint32_t>();
+        }
+        else if (result.count("growth-percent"))
+            growth.percent = result["growth-percent"].as<uint32_t>();
+        chain.set_growth(growth);
+
+        if (result.count("verify"))
+        {
+            const auto report = chain.verify();
+            std::cout << "Verified " << report.checked << " outputs"
+                << std::endl;
+            if (!report.bad.empty())
+            {
+                std::cerr << "Error invalid points at";
+                for (const auto index: report.bad)
+                    std::cerr << " " << index;
+                std::cerr << std::endl;
+                return -1;
+            }
+        }
+
+        dark::message_server messages(server.sequencer());
+        std::thread thread([&messages] { messages.start(); });
 
         server.start();
+        // Joined while the logger and metrics it uses still exist
+        messages.stop();
+        thread.join();
         return 0;
     }
 
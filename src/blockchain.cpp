@@ -1,7 +1,17 @@
 #include <dark/blockchain.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
 #include <memory>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <boost/filesystem.hpp>
+#include <dark/blockchain_snapshot.hpp>
+#include <dark/commitment_index.hpp>
+#include <dark/merkle_tree.hpp>
+#include <dark/point_cache.hpp>
 
 namespace dark {
 
@@ -19,86 +29,1899 @@ std::string filepath(fs::path prefix, const char* filename)
     return prefix.native();
 }
 
-blockchain::blockchain(const char* prefix)
+constexpr size_t free_record_size = sizeof(output_index_type);
+
+typedef bc::database::record_manager<output_index_type> records_type;
+typedef std::unique_ptr<records_type> records_uniq;
+typedef std::unique_ptr<bc::database::file_storage> storage_uniq;
+
+// Files of one shard. Chains with a single shard use the bare names.
+struct blockchain_shard
+{
+    // Whole records for the classic layout, x coordinates for dense.
+    storage_uniq records_storage;
+    records_uniq records;
+
+    // Dense layout columns, indexed by slot like records.
+    storage_uniq time_storage;
+    records_uniq time_column;
+    storage_uniq parity_storage;
+
+    // Stack of spent output indexes stored next to the outputs file.
+    storage_uniq free_storage;
+    records_uniq free_records;
+    // Slots on the free stack, so none is pushed twice
+    std::vector<bool> freed;
+
+    // Hash index from commitments to live output indexes.
+    std::unique_ptr<commitment_index> index;
+
+    // Spent slots held back from the free stack for older snapshots.
+    typedef std::pair<generation_type, output_index_type> pending_record;
+    std::deque<pending_record> pending_free;
+
+    // Held by commits touching this shard
+    std::mutex mutex;
+};
+
+std::string shard_filename(const char* name, size_t shard, size_t shards)
+{
+    if (shards == 1)
+        return name;
+    return std::string(name) + "." + std::to_string(shard);
+}
+
+// Opens a record file, creating it if missing. Returns true if created.
+// Files grown by a growth_policy have no expansion of their own.
+bool open_records(const std::string& filename, size_t record_size,
+    storage_uniq& storage, records_uniq& records,
+    size_t expansion = bc::database::file_storage::default_expansion)
+{
+    const bool create = !fs::exists(filename);
+    if (create)
+        touch_file(filename);
+
+    storage = std::make_unique<bc::database::file_storage>(filename,
+        bc::database::file_storage::default_capacity, expansion);
+    records = std::make_unique<records_type>(*storage, 0, record_size);
+
+    storage->open();
+    if (create)
+        records->create();
+    records->start();
+    return create;
+}
+
+// The live bitmap is an array of native 64 bit words.
+typedef uint64_t live_word;
+constexpr size_t live_word_bits = 64;
+
+size_t live_words(const size_t records_count)
+{
+    return (records_count + live_word_bits - 1) / live_word_bits;
+}
+
+// record_manager stores its count before the first record.
+constexpr size_t records_offset = sizeof(output_index_type);
+
+// Dense points files start with [magic:4][version:4][unused:20] before
+// the count, so the x coordinates begin on a 32 byte boundary.
+constexpr size_t points_header_size = 28;
+constexpr size_t points_offset = points_header_size + records_offset;
+constexpr size_t point_x_size = 32;
+constexpr uint32_t points_magic = 0x64726b70;
+constexpr size_t time_column_size = 4;
+
+// Reads a classic record. The prefix byte may be tombstoned by a
+// concurrent remove, so it is loaded atomically.
+output_record decode_record(const uint8_t* buffer)
+{
+    output_record record;
+    std::copy(buffer, buffer + bcs::ec_compressed_size, record.point.begin());
+    record.point[0] = __atomic_load_n(buffer, __ATOMIC_ACQUIRE);
+    auto deserial = bcs::make_unsafe_deserializer(
+        buffer + bcs::ec_compressed_size);
+    record.time = deserial.read_4_bytes_little_endian();
+    return record;
+}
+
+output_record decode_record(const uint8_t* x, bool odd, const uint8_t* time)
+{
+    output_record record;
+    record.point[0] = odd ? 3 : 2;
+    std::copy(x, x + point_x_size, record.point.begin() + 1);
+    auto deserial = bcs::make_unsafe_deserializer(time);
+    record.time = deserial.read_4_bytes_little_endian();
+    return record;
+}
+
+bool test_bit(const uint8_t* buffer, size_t bit)
+{
+    const auto* words = reinterpret_cast<const live_word*>(buffer);
+    const auto word = __atomic_load_n(&words[bit / live_word_bits],
+        __ATOMIC_ACQUIRE);
+    return (word & (live_word(1) << (bit % live_word_bits))) != 0;
+}
+
+void assign_bit(uint8_t* buffer, size_t bit, bool value)
+{
+    auto* words = reinterpret_cast<live_word*>(buffer);
+    const auto mask = live_word(1) << (bit % live_word_bits);
+    if (value)
+        __atomic_fetch_or(&words[bit / live_word_bits], mask,
+            __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_and(&words[bit / live_word_bits], ~mask,
+            __ATOMIC_RELEASE);
+}
+// Records fetched ahead of the one handed to a scan callback.
+constexpr size_t scan_prefetch_distance = 8;
+
+// Applies an madvise() hint to the whole pages spanning [begin, end).
+void advise_range(const uint8_t* begin, const uint8_t* end, int advice)
+{
+    static const auto page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const auto first = reinterpret_cast<uintptr_t>(begin) & ~(page_size - 1);
+    const auto last = reinterpret_cast<uintptr_t>(end);
+    if (last > first)
+        madvise(reinterpret_cast<void*>(first), last - first, advice);
+}
+
+// Adds the point, or its negation, into a sum stored as a compressed
+// point with an all zero encoding for the point at infinity.
+void add_to_sum(uint8_t* sum, const bcs::ec_compressed& point, bool negate)
+{
+    bcs::ec_compressed term = point;
+    // Flipping the parity of y negates the point
+    if (negate)
+        term[0] ^= 1;
+
+    bcs::ec_compressed current;
+    std::copy(sum, sum + bcs::ec_compressed_size, current.begin());
+    if (current[0] == 0)
+    {
+        std::copy(term.begin(), term.end(), sum);
+        return;
+    }
+    // Adding the negation of the sum gives infinity
+    if ((current[0] ^ term[0]) == 1 &&
+        std::equal(term.begin() + 1, term.end(), current.begin() + 1))
+    {
+        std::fill(sum, sum + bcs::ec_compressed_size, 0);
+        return;
+    }
+
+    const auto result = bcs::ec_point(current) + bcs::ec_point(term);
+    std::copy(result.point().begin(), result.point().end(), sum);
+}
+
+// Time index entries are [time:4][index:4] in commit order.
+constexpr size_t time_entry_size = 4 + 4;
+
+// Compact the time index once spent entries outnumber live ones.
+constexpr size_t time_compact_minimum = 4096;
+
+// Journal layout: [base sequence:8] followed by frames of
+// [body size:4][sequence:8][payload][sha256(sequence + payload):32]
+constexpr size_t journal_header_size = sizeof(uint64_t);
+constexpr size_t journal_checkpoint_size = 1024 * 1024;
+
+void blockchain_batch::put(const bcs::ec_compressed& point)
+{
+    puts_.push_back(point);
+}
+void blockchain_batch::remove(const output_index_type index)
+{
+    removes_.push_back(index);
+}
+
+void blockchain_batch::append(const blockchain_batch& other)
+{
+    removes_.insert(removes_.end(), other.removes_.begin(),
+        other.removes_.end());
+    puts_.insert(puts_.end(), other.puts_.begin(), other.puts_.end());
+}
+
+bool blockchain_batch::is_removed(const output_index_type index) const
+{
+    return std::find(removes_.begin(), removes_.end(), index) !=
+        removes_.end();
+}
+bool blockchain_batch::is_put(const bcs::ec_compressed& point) const
+{
+    return std::find(puts_.begin(), puts_.end(), point) != puts_.end();
+}
+bool blockchain_batch::overlaps(const blockchain_batch& other) const
+{
+    return std::any_of(other.removes_.begin(), other.removes_.end(),
+        [this](const output_index_type index)
+        {
+            return is_removed(index);
+        });
+}
+
+size_t blockchain_batch::puts_count() const
+{
+    return puts_.size();
+}
+bool blockchain_batch::empty() const
+{
+    return removes_.empty() && puts_.empty();
+}
+
+const output_index_list& blockchain_batch::removes() const
+{
+    return removes_;
+}
+const bcs::point_list& blockchain_batch::puts() const
+{
+    return puts_;
+}
+
+blockchain::blockchain(const char* prefix, size_t shards,
+    record_layout layout)
+  : layout_(layout)
+{
+    fs::create_directories(prefix);
+
+    // The shard count and layout are fixed when the chain is created.
+    // Chains without these files predate them: one classic shard.
+    const auto shards_path = filepath(prefix, "shards");
+    const auto layout_path = filepath(prefix, "layout");
+    const bool create = !fs::exists(filepath(prefix, "outputs")) &&
+        !fs::exists(filepath(prefix, "outputs.0")) &&
+        !fs::exists(layout_path);
+    if (create)
+    {
+        BITCOIN_ASSERT(shards > 0);
+        std::ofstream shards_file(shards_path);
+        shards_file << shards << std::endl;
+        std::ofstream layout_file(layout_path);
+        layout_file << static_cast<uint32_t>(layout_) << std::endl;
+    }
+    else
+    {
+        shards = 1;
+        if (fs::exists(shards_path))
+        {
+            std::ifstream file(shards_path);
+            file >> shards;
+        }
+        uint32_t version = static_cast<uint32_t>(record_layout::classic);
+        if (fs::exists(layout_path))
+        {
+            std::ifstream file(layout_path);
+            file >> version;
+        }
+        layout_ = static_cast<record_layout>(version);
+    }
+
+    bool create_free = false;
+    bool create_index = false;
+    for (size_t i = 0; i < shards; ++i)
+    {
+        auto shard = std::make_unique<blockchain_shard>();
+        open_shard_records(*shard, prefix, i, shards);
+
+        // Older chains have no free stack or index, so they get rebuilt.
+        create_free = open_records(filepath(prefix,
+                shard_filename("free", i, shards).c_str()),
+            free_record_size,
+            shard->free_storage, shard->free_records) || create_free;
+
+        const auto index_path = filepath(prefix,
+            shard_filename("index", i, shards).c_str());
+        if (!fs::exists(index_path))
+        {
+            touch_file(index_path);
+            create_index = true;
+        }
+        shard->index = std::make_unique<commitment_index>(index_path);
+
+        shards_.push_back(std::move(shard));
+    }
+
+    const bool create_live = !fs::exists(filepath(prefix, "live"));
+    if (create_live)
+        touch_file(filepath(prefix, "live"));
+    live_storage_ = std::make_unique<bc::database::file_storage>(
+        filepath(prefix, "live"));
+    live_storage_->open();
+    if (create_live)
+        rebuild_live_bitmap();
+    if (create_index)
+        rebuild_commitment_index();
+    if (create_free)
+        rebuild_free_records();
+
+    const bool create_sum = !fs::exists(filepath(prefix, "sum"));
+    if (create_sum)
+        touch_file(filepath(prefix, "sum"));
+    sum_storage_ = std::make_unique<bc::database::file_storage>(
+        filepath(prefix, "sum"));
+    sum_storage_->open();
+    if (create_sum)
+        rebuild_commitment_sum();
+
+    journal_time_ = 0;
+    const bool create_times = open_records(filepath(prefix, "times"),
+        time_entry_size, times_storage_, times_);
+    if (create_times)
+        rebuild_time_index();
+    else if (times_->count() > 0)
+        for_each_newest([this](output_index_type, uint32_t time)
+        {
+            journal_time_ = time;
+            return false;
+        });
+
+    const bool create_journal = !fs::exists(filepath(prefix, "journal"));
+    if (create_journal)
+        touch_file(filepath(prefix, "journal"));
+    journal_storage_ = std::make_unique<bc::database::file_storage>(
+        filepath(prefix, "journal"));
+    journal_storage_->open();
+    if (create_journal)
+    {
+        auto memory = journal_storage_->resize(journal_header_size);
+        auto serial = bcs::make_unsafe_serializer(memory->buffer());
+        serial.write_8_bytes_little_endian(0);
+    }
+
+    // Chains from before the marker count as unclean once, new ones
+    // start clean
+    const auto clean_path = filepath(prefix, "clean");
+    if (!fs::exists(clean_path))
+    {
+        std::ofstream file(clean_path);
+        file.put(create ? 1 : 0);
+    }
+    clean_storage_ = std::make_unique<bc::database::file_storage>(
+        clean_path);
+    clean_storage_->open();
+    {
+        auto memory = clean_storage_->access();
+        clean_ = memory->buffer()[0] == 1;
+    }
+    recover_journal();
+
+    // Slots held back for snapshots are lost if the process dies.
+    size_t free_count = 0, slots_count = 0;
+    for (const auto& shard: shards_)
+    {
+        free_count += shard->free_records->count();
+        slots_count += shard->records->count();
+    }
+    if (free_count + live_count() != slots_count || !load_free_slots())
+        rebuild_free_records();
+
+    // Everything on disk is visible to snapshots of generation 0
+    generation_ = 0;
+    journal_generation_ = 0;
+    versions_ = std::make_unique<record_versions>();
+    versions_->reserve(count());
+    for_each_live_index(0, count(), [this](output_index_type index)
+    {
+        versions_->created(index, 0);
+    });
+
+    // A saved tree is only good for the open right after its close
+    merkle_path_ = filepath(prefix, "merkle");
+    merkle_ = std::make_unique<merkle_tree>();
+    if (!merkle_->load(merkle_path_, journal_sequence_) ||
+        merkle_->size() != count())
+        rebuild_merkle_tree();
+    fs::remove(merkle_path_);
+}
+
+typedef std::function<std::string (const char*)> shard_path_function;
+
+// Opens the points, created and parity files of a dense shard.
+void open_dense_records(blockchain_shard& shard,
+    const shard_path_function& path)
+{
+    const auto points_path = path("points");
+    const bool create = !fs::exists(points_path);
+    if (create)
+        touch_file(points_path);
+    shard.records_storage = std::make_unique<bc::database::file_storage>(
+        points_path, bc::database::file_storage::default_capacity, 0);
+    shard.records = std::make_unique<records_type>(*shard.records_storage,
+        points_header_size, point_x_size);
+    shard.records_storage->open();
+    if (create)
+    {
+        shard.records->create();
+        auto memory = shard.records_storage->access();
+        auto serial = bcs::make_unsafe_serializer(memory->buffer());
+        serial.write_4_bytes_little_endian(points_magic);
+        serial.write_4_bytes_little_endian(
+            static_cast<uint32_t>(record_layout::dense));
+    }
+    else
+    {
+        auto memory = shard.records_storage->access();
+        auto deserial = bcs::make_unsafe_deserializer(memory->buffer());
+        const auto magic = deserial.read_4_bytes_little_endian();
+        const auto version = deserial.read_4_bytes_little_endian();
+        if (magic != points_magic ||
+            version != static_cast<uint32_t>(record_layout::dense))
+        {
+            std::cerr << "blockchain: " << points_path
+                << " is not a dense points file" << std::endl;
+            BITCOIN_ASSERT(false);
+        }
+    }
+    shard.records->start();
+
+    open_records(path("created"), time_column_size,
+        shard.time_storage, shard.time_column);
+    if (!fs::exists(path("parity")))
+        touch_file(path("parity"));
+    shard.parity_storage = std::make_unique<bc::database::file_storage>(
+        path("parity"));
+    shard.parity_storage->open();
+}
+
+shard_path_function shard_path(const char* prefix, size_t shard_index,
+    size_t shards)
+{
+    return [prefix, shard_index, shards](const char* name)
+    {
+        return filepath(prefix,
+            shard_filename(name, shard_index, shards).c_str());
+    };
+}
+
+void blockchain::open_shard_records(blockchain_shard& shard,
+    const char* prefix, size_t shard_index, size_t shards)
+{
+    const auto path = shard_path(prefix, shard_index, shards);
+    if (layout_ == record_layout::dense)
+    {
+        open_dense_records(shard, path);
+        return;
+    }
+    BITCOIN_ASSERT(layout_ == record_layout::classic);
+    open_records(path("outputs"), blockchain_record_size,
+        shard.records_storage, shard.records, 0);
+}
+
+bool blockchain::convert_to_dense(const char* prefix)
+{
+    size_t shards;
+    {
+        // Replays any journal and checkpoints, completing the outputs
+        blockchain chain(prefix);
+        if (chain.layout() != record_layout::classic)
+            return false;
+        shards = chain.shards_count();
+    }
+
+    size_t converted = 0;
+    for (size_t i = 0; i < shards; ++i)
+    {
+        const auto path = shard_path(prefix, i, shards);
+        blockchain_shard classic;
+        open_records(path("outputs"), blockchain_record_size,
+            classic.records_storage, classic.records);
+
+        // Leftovers of an interrupted conversion are started over
+        fs::remove(path("points"));
+        fs::remove(path("created"));
+        fs::remove(path("parity"));
+        blockchain_shard dense;
+        open_dense_records(dense, path);
+
+        const auto slots = classic.records->count();
+        if (slots > 0)
+        {
+            dense.records_storage->reserve(points_offset +
+                size_t(slots) * point_x_size);
+            dense.records->allocate(slots);
+            dense.records->commit();
+            dense.time_column->allocate(slots);
+            dense.time_column->commit();
+            dense.parity_storage->reserve(
+                live_words(slots) * sizeof(live_word));
+        }
+
+        auto source = classic.records_storage->access();
+        auto points = dense.records_storage->access();
+        auto times = dense.time_storage->access();
+        auto parity = dense.parity_storage->access();
+        const auto* record = source->buffer() + records_offset;
+        auto* x = points->buffer() + points_offset;
+        auto* time = times->buffer() + records_offset;
+        for (size_t slot = 0; slot < slots; ++slot)
+        {
+            // Spent records keep a zero prefix, which reads as even
+            std::copy(record + 1, record + bcs::ec_compressed_size, x);
+            std::copy(record + bcs::ec_compressed_size,
+                record + blockchain_record_size, time);
+            assign_bit(parity->buffer(), slot, record[0] == 3);
+            record += blockchain_record_size;
+            x += point_x_size;
+            time += time_column_size;
+        }
+        source.reset();
+        points.reset();
+        times.reset();
+        parity.reset();
+
+        dense.records_storage->flush();
+        dense.time_storage->flush();
+        dense.parity_storage->flush();
+        converted += slots;
+    }
+
+    // Switching the layout file over is the commit point
+    const auto layout_path = filepath(prefix, "layout");
+    const auto staged_path = layout_path + ".new";
+    {
+        std::ofstream file(staged_path);
+        file << static_cast<uint32_t>(record_layout::dense) << std::endl;
+    }
+    fs::rename(staged_path, layout_path);
+    for (size_t i = 0; i < shards; ++i)
+        fs::remove(shard_path(prefix, i, shards)("outputs"));
+
+    std::cout << "blockchain: converted " << converted << " records in "
+        << shards << " shards to the dense layout" << std::endl;
+    return true;
+}
+
+bool blockchain::import_file(const char* path, const char* prefix)
 {
-    bool create_new = false;
-    if (fs::create_directories(prefix))
+    if (fs::exists(prefix))
+    {
+        std::cerr << "blockchain: " << prefix << " already exists" << std::endl;
+        return false;
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    bcs::data_chunk header(snapshot_file_header_size);
+    file.read(reinterpret_cast<char*>(header.data()), header.size());
+    auto deserial = bcs::make_unsafe_deserializer(header.begin());
+    const auto magic = deserial.read_4_bytes_little_endian();
+    const auto version = deserial.read_4_bytes_little_endian();
+    const auto shards = deserial.read_4_bytes_little_endian();
+    const auto layout = static_cast<record_layout>(
+        deserial.read_4_bytes_little_endian());
+    const auto chain_count = deserial.read_4_bytes_little_endian();
+    const auto live = deserial.read_4_bytes_little_endian();
+    deserial.skip(8);
+    const auto checksum = deserial.read_8_bytes_little_endian();
+    if (!file || magic != snapshot_file_magic ||
+        version != snapshot_file_version || shards == 0 ||
+        (layout != record_layout::classic && layout != record_layout::dense))
     {
-        touch_file(filepath(prefix, "outputs"));
-        create_new = true;
+        std::cerr << "blockchain: " << path << " is not a snapshot file"
+            << std::endl;
+        return false;
     }
 
-    records_storage_ = std::make_unique<bc::database::file_storage>(
-        filepath(prefix, "outputs"));
-    records_ = std::make_unique<records_type>(
-        *records_storage_, 0, blockchain_record_size);
+    // Build beside the target so a failed import leaves nothing behind
+    const auto staging = std::string(prefix) + ".import";
+    fs::remove_all(staging);
+    bool imported;
+    {
+        // Points are routed to shards by hash, so the count must match
+        blockchain chain(staging.c_str(), shards, layout);
+        imported = chain.import_records(file, chain_count, live, checksum);
+    }
+    if (!imported)
+    {
+        std::cerr << "blockchain: " << path << " is corrupt" << std::endl;
+        fs::remove_all(staging);
+        return false;
+    }
+    fs::rename(staging, prefix);
+
+    std::cout << "blockchain: imported " << live << " outputs" << std::endl;
+    return true;
+}
+
+bool blockchain::import_records(std::istream& file,
+    output_index_type chain_count, output_index_type live, uint64_t checksum)
+{
+    // Every slot below the exported count is allocated, so indexes keep
+    // their meaning and the rest become free slots.
+    const auto shards = shards_.size();
+    for (size_t i = 0; i < shards; ++i)
+        if (chain_count > i)
+            allocate_records(*shards_[i], (chain_count - i - 1) / shards + 1);
+    reserve_live_bitmap();
 
-    records_storage_->open();
-    if(create_new)
+    constexpr size_t block_records = 4096;
+    bcs::data_chunk block(block_records * snapshot_file_record_size);
+    auto computed = snapshot_file_checksum_basis;
+    output_index_type read = 0;
+    int64_t previous = -1;
+    while (read < live)
     {
-        records_->create();
+        const auto records = std::min<size_t>(block_records, live - read);
+        const auto size = records * snapshot_file_record_size;
+        if (!file.read(reinterpret_cast<char*>(block.data()), size))
+            return false;
+        computed = snapshot_file_checksum(computed, block.data(), size);
+
+        auto deserial = bcs::make_unsafe_deserializer(block.begin());
+        for (size_t i = 0; i < records; ++i)
+        {
+            const auto index = deserial.read_4_bytes_little_endian();
+            const auto point = deserial.read_forward<bcs::ec_compressed_size>();
+            const auto time = deserial.read_4_bytes_little_endian();
+            if (index >= chain_count || index <= previous ||
+                (point[0] != 2 && point[0] != 3))
+                return false;
+            previous = index;
+            write_record(index, point, time);
+            set_live(index, true);
+        }
+        read += records;
     }
-    records_->start();
+    if (computed != checksum || file.peek() != std::char_traits<char>::eof())
+        return false;
+
+    rebuild_commitment_index();
+    rebuild_free_records();
+    rebuild_commitment_sum();
+    rebuild_time_index();
+    checkpoint();
+    return true;
 }
 
 blockchain::~blockchain()
 {
+    BITCOIN_ASSERT(snapshots_.empty());
+    stop_flusher();
+    for (auto& shard: shards_)
+        release_pending_records(*shard);
+    checkpoint();
+    if (!merkle_->save(merkle_path_, journal_sequence_))
+        std::cerr << "blockchain: failed writing " << merkle_path_
+            << std::endl;
+}
+
+boost::optional<bcs::ec_compressed> blockchain::commitment_sum() const
+{
+    std::lock_guard<std::mutex> lock(sum_mutex_);
+    auto memory = sum_storage_->access();
+    const auto* sum = memory->buffer();
+    if (sum[0] == 0)
+        return boost::none;
+    bcs::ec_compressed result;
+    std::copy(sum, sum + bcs::ec_compressed_size, result.begin());
+    return result;
+}
+
+size_t blockchain::shards_count() const
+{
+    return shards_.size();
+}
+record_layout blockchain::layout() const
+{
+    return layout_;
+}
+
+size_t blockchain::shard_of(const output_index_type index) const
+{
+    return index % shards_.size();
+}
+output_index_type blockchain::slot_of(const output_index_type index) const
+{
+    return index / shards_.size();
+}
+
+size_t blockchain::shard_for(const bcs::ec_compressed& point,
+    size_t shards)
+{
+    // The x coordinate is uniformly distributed
+    auto deserial = bcs::make_unsafe_deserializer(point.begin() + 1);
+    return deserial.read_4_bytes_little_endian() % shards;
+}
+size_t blockchain::shard_for(const bcs::ec_compressed& point) const
+{
+    return shard_for(point, shards_.size());
+}
+
+bool blockchain::allocated(const output_index_type index) const
+{
+    return slot_of(index) < shards_[shard_of(index)]->records->count();
+}
+
+output_record blockchain::read_record(const output_index_type index) const
+{
+    const auto& shard = *shards_[shard_of(index)];
+    const auto slot = slot_of(index);
+    auto memory = shard.records->get(slot);
+    if (layout_ == record_layout::classic)
+        return decode_record(memory->buffer());
+
+    auto time = shard.time_column->get(slot);
+    auto parity = shard.parity_storage->access();
+    auto record = decode_record(memory->buffer(),
+        test_bit(parity->buffer(), slot), time->buffer());
+    // Read back like a tombstoned classic record once spent
+    if (!live(index))
+        record.point[0] = 0;
+    return record;
+}
+
+bool blockchain::live(const output_index_type index) const
+{
+    auto memory = live_storage_->access();
+    return test_bit(memory->buffer(), index);
+}
+
+blockchain::staged_output_list blockchain::resolve_outputs(
+    const bcs::point_list& puts)
+{
+    // Puts already placed in each shard by this batch
+    std::vector<size_t> placed(shards_.size(), 0);
+    staged_output_list outputs;
+    for (const auto& point: puts)
+    {
+        const auto shard_index = shard_for(point);
+        auto& shard = *shards_[shard_index];
+        const auto position = placed[shard_index]++;
+        const auto free_count = shard.free_records->count();
+        if (position >= free_count)
+        {
+            const output_index_type slot = shard.records->count() +
+                (position - free_count);
+            const output_index_type index =
+                slot * shards_.size() + shard_index;
+            outputs.push_back({ index, point });
+            continue;
+        }
+
+        // Take spent slots from the top of the stack downwards
+        auto memory = shard.free_records->get(free_count - 1 - position);
+        auto deserial = bcs::make_unsafe_deserializer(memory->buffer());
+        outputs.push_back({ deserial.read_4_bytes_little_endian(), point });
+    }
+    return outputs;
+}
+
+void blockchain::write_record(const output_index_type index,
+    const bcs::ec_compressed& point, const uint32_t time)
+{
+    const auto& shard = *shards_[shard_of(index)];
+    const auto slot = slot_of(index);
+    auto memory = shard.records->get(slot);
+    auto* buffer = memory->buffer();
+    if (layout_ == record_layout::classic)
+    {
+        std::copy(point.begin(), point.end(), buffer);
+        // Write time
+        auto serial = bcs::make_unsafe_serializer(
+            buffer + bcs::ec_compressed_size);
+        serial.write_4_bytes_little_endian(time);
+        return;
+    }
+
+    std::copy(point.begin() + 1, point.end(), buffer);
+    memory.reset();
+    auto column = shard.time_column->get(slot);
+    auto serial = bcs::make_unsafe_serializer(column->buffer());
+    serial.write_4_bytes_little_endian(time);
+    auto parity = shard.parity_storage->access();
+    assign_bit(parity->buffer(), slot, point[0] == 3);
+}
+
+void blockchain::tombstone_record(const output_index_type index)
+{
+    // Dense records stay intact and are spent only in the live bitmap
+    if (layout_ != record_layout::classic)
+        return;
+    auto memory = shards_[shard_of(index)]->records->get(slot_of(index));
+    __atomic_store_n(memory->buffer(), uint8_t(0), __ATOMIC_RELEASE);
+}
+
+void blockchain::allocate_records(blockchain_shard& shard, size_t added)
+{
+    reserve_records(shard, added);
+    shard.records->allocate(added);
+    shard.records->commit();
+    if (layout_ == record_layout::classic)
+        return;
+
+    shard.time_column->allocate(added);
+    shard.time_column->commit();
+    const auto size = live_words(shard.records->count()) * sizeof(live_word);
+    if (size > shard.parity_storage->logical())
+        shard.parity_storage->reserve(size);
+}
+
+void blockchain::reserve_records(blockchain_shard& shard, size_t added)
+{
+    const bool dense = layout_ == record_layout::dense;
+    const auto record_size = dense ? point_x_size : blockchain_record_size;
+    auto& storage = *shard.records_storage;
+    const auto required = (dense ? points_offset : records_offset) +
+        (shard.records->count() + added) * record_size;
+    const auto capacity = storage.capacity();
+    if (required <= capacity)
+        return;
+
+    growth_policy policy;
+    {
+        std::lock_guard<std::mutex> lock(growth_mutex_);
+        policy = growth_;
+    }
+    size_t target = required;
+    if (policy.mode == growth_mode::fixed)
+        target += size_t(policy.chunk_records) * record_size;
+    else
+        target = std::max(target, capacity + capacity * policy.percent / 100);
+
+    // Remaps once here so allocate() finds the capacity already there
+    storage.reserve(target);
+    ++records_remaps_;
+}
+
+void blockchain::set_growth(const growth_policy& policy)
+{
+    std::lock_guard<std::mutex> lock(growth_mutex_);
+    growth_ = policy;
+}
+
+size_t blockchain::records_remaps() const
+{
+    return records_remaps_;
+}
+
+void blockchain::release_record(const output_index_type index)
+{
+    auto& shard = *shards_[shard_of(index)];
+    const auto slot = slot_of(index);
+    // A live slot, or one already on the stack, would be reused twice
+    if (!allocated(index) || live(index) ||
+        (slot < shard.freed.size() && shard.freed[slot]))
+    {
+        std::cerr << "blockchain: slot " << index << " is not free"
+            << std::endl;
+        return;
+    }
+    if (slot >= shard.freed.size())
+        shard.freed.resize(shard.records->count());
+    shard.freed[slot] = true;
+
+    auto& free_records = *shard.free_records;
+    const auto top = free_records.allocate(1);
+    auto memory = free_records.get(top);
+    auto serial = bcs::make_unsafe_serializer(memory->buffer());
+    serial.write_4_bytes_little_endian(index);
+    memory.reset();
+    free_records.commit();
+}
+
+void blockchain::release_pending_records(blockchain_shard& shard)
+{
+    auto oldest = std::numeric_limits<generation_type>::max();
+    {
+        std::lock_guard<std::mutex> lock(snapshots_mutex_);
+        if (!snapshots_.empty())
+            oldest = *snapshots_.begin();
+    }
+
+    // A slot removed by commit g is only seen by snapshots before g
+    auto& pending = shard.pending_free;
+    while (!pending.empty() && pending.front().first <= oldest)
+    {
+        release_record(pending.front().second);
+        pending.pop_front();
+    }
 }
 
-output_index_type blockchain::next_available_record()
+void blockchain::rebuild_free_records()
 {
+    output_index_list spent;
     const auto chain_count = count();
+    {
+        auto memory = live_storage_->access();
+        const auto* words = reinterpret_cast<const live_word*>(
+            memory->buffer());
+        for (size_t i = 0; i < live_words(chain_count); ++i)
+        {
+            auto word = ~words[i];
+            while (word != 0)
+            {
+                const auto index = i * live_word_bits + __builtin_ctzll(word);
+                if (index >= chain_count)
+                    break;
+                if (allocated(index))
+                    spent.push_back(index);
+                word &= word - 1;
+            }
+        }
+    }
+
+    for (auto& shard: shards_)
+    {
+        shard->free_records->set_count(0);
+        shard->free_records->commit();
+        shard->freed.assign(shard->records->count(), false);
+    }
+    // Push in reverse so the lowest spent slots are reused first
+    for (auto it = spent.rbegin(); it != spent.rend(); ++it)
+        release_record(*it);
+}
+
+bool blockchain::load_free_slots()
+{
+    for (size_t shard_index = 0; shard_index < shards_.size(); ++shard_index)
+    {
+        auto& shard = *shards_[shard_index];
+        shard.freed.assign(shard.records->count(), false);
+        for (size_t i = 0; i < shard.free_records->count(); ++i)
+        {
+            auto memory = shard.free_records->get(i);
+            auto deserial = bcs::make_unsafe_deserializer(memory->buffer());
+            const auto index = deserial.read_4_bytes_little_endian();
+            if (shard_of(index) != shard_index || !allocated(index) ||
+                live(index) || shard.freed[slot_of(index)])
+                return false;
+            shard.freed[slot_of(index)] = true;
+        }
+    }
+    return true;
+}
+
+void blockchain::reserve_live_bitmap()
+{
+    const auto size = live_words(count()) * sizeof(live_word);
+    if (size > live_storage_->logical())
+        live_storage_->reserve(size);
+}
+
+void blockchain::set_live(const output_index_type index, bool live)
+{
+    // Neighbouring bits belong to other shards' concurrent commits
+    auto memory = live_storage_->access();
+    assign_bit(memory->buffer(), index, live);
+}
+
+void blockchain::rebuild_commitment_index()
+{
+    for (auto& shard: shards_)
+        shard->index->clear();
+    for_each_live(0, count(),
+        [this](output_index_type index, const output_record& record)
+    {
+        shards_[shard_of(index)]->index->insert(record.point, index);
+    });
+}
+
+void blockchain::rebuild_live_bitmap()
+{
+    // Only classic records say whether they are spent
+    if (layout_ != record_layout::classic && count() > 0)
+    {
+        std::cerr << "blockchain: the live bitmap of a dense chain "
+            "cannot be rebuilt" << std::endl;
+        BITCOIN_ASSERT(false);
+        return;
+    }
+
+    reserve_live_bitmap();
+    const auto chain_count = count();
+    auto memory = live_storage_->access();
+    auto* words = reinterpret_cast<live_word*>(memory->buffer());
+    std::fill(words, words + live_words(chain_count), 0);
     for (size_t i = 0; i < chain_count; ++i)
-        if (!exists(i))
-            return i;
-    const auto index = records_->allocate(1);
-    records_->commit();
-    return index;
+    {
+        if (!allocated(i))
+            continue;
+        if (read_record(i).point[0] != 0)
+            words[i / live_word_bits] |= live_word(1) << (i % live_word_bits);
+    }
+}
+
+void blockchain::rebuild_commitment_sum()
+{
+    std::lock_guard<std::mutex> lock(sum_mutex_);
+    auto memory = sum_storage_->reserve(bcs::ec_compressed_size);
+    auto* sum = memory->buffer();
+    std::fill(sum, sum + bcs::ec_compressed_size, 0);
+    memory.reset();
+
+    bcs::ec_compressed total;
+    total.fill(0);
+    for_each_live(0, count(),
+        [&total](output_index_type, const output_record& record)
+    {
+        add_to_sum(total.data(), record.point, false);
+    });
+
+    memory = sum_storage_->access();
+    std::copy(total.begin(), total.end(), memory->buffer());
+}
+
+void blockchain::append_times(const uint32_t time,
+    const staged_output_list& puts)
+{
+    if (puts.empty())
+        return;
+    std::lock_guard<std::mutex> lock(times_mutex_);
+    const auto first = times_->allocate(puts.size());
+    for (size_t i = 0; i < puts.size(); ++i)
+    {
+        auto memory = times_->get(first + i);
+        auto serial = bcs::make_unsafe_serializer(memory->buffer());
+        serial.write_4_bytes_little_endian(time);
+        serial.write_4_bytes_little_endian(puts[i].index);
+    }
+    times_->commit();
+}
+
+void blockchain::rebuild_time_index()
+{
+    typedef std::pair<uint32_t, output_index_type> time_entry;
+    std::vector<time_entry> entries;
+    for_each_live(0, count(),
+        [&entries](output_index_type index, const output_record& record)
+    {
+        entries.emplace_back(record.time, index);
+    });
+    std::sort(entries.begin(), entries.end());
+
+    std::lock_guard<std::mutex> lock(times_mutex_);
+    times_->set_count(0);
+    if (!entries.empty())
+        times_->allocate(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i)
+    {
+        auto memory = times_->get(i);
+        auto serial = bcs::make_unsafe_serializer(memory->buffer());
+        serial.write_4_bytes_little_endian(entries[i].first);
+        serial.write_4_bytes_little_endian(entries[i].second);
+    }
+    times_->commit();
+    if (!entries.empty())
+        journal_time_ = std::max(journal_time_, entries.back().first);
+}
+
+void blockchain::for_each_created(const uint32_t from, const uint32_t to,
+    time_entry_handler handler) const
+{
+    std::lock_guard<std::mutex> lock(times_mutex_);
+    const auto entries_count = times_->count();
+    auto memory = times_storage_->access();
+    const auto* entries = memory->buffer() + records_offset;
+    const auto time_at = [entries](size_t position)
+    {
+        auto deserial = bcs::make_unsafe_deserializer(
+            entries + position * time_entry_size);
+        return deserial.read_4_bytes_little_endian();
+    };
+
+    // Entries are sorted by time, so binary search for the first one
+    size_t low = 0, high = entries_count;
+    while (low < high)
+    {
+        const auto middle = low + (high - low) / 2;
+        if (time_at(middle) < from)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (auto position = low; position < entries_count; ++position)
+    {
+        auto deserial = bcs::make_unsafe_deserializer(
+            entries + position * time_entry_size);
+        const auto time = deserial.read_4_bytes_little_endian();
+        if (time >= to)
+            return;
+        if (!handler(deserial.read_4_bytes_little_endian(), time))
+            return;
+    }
+}
+
+void blockchain::for_each_newest(time_entry_handler handler) const
+{
+    std::lock_guard<std::mutex> lock(times_mutex_);
+    auto memory = times_storage_->access();
+    const auto* entries = memory->buffer() + records_offset;
+    for (auto position = times_->count(); position > 0; --position)
+    {
+        auto deserial = bcs::make_unsafe_deserializer(
+            entries + (position - 1) * time_entry_size);
+        const auto time = deserial.read_4_bytes_little_endian();
+        if (!handler(deserial.read_4_bytes_little_endian(), time))
+            return;
+    }
 }
 
 output_index_type blockchain::put(const bcs::ec_compressed& point)
 {
-    const auto new_record_index = next_available_record();
-    auto memory = records_->get(new_record_index);
-    auto* buffer = memory->buffer();
-    std::copy(point.begin(), point.end(), buffer);
-    // Write time
-    auto serial = bcs::make_unsafe_serializer(buffer + bcs::ec_compressed_size);
-    const auto time = std::time(nullptr);
-    serial.write_4_bytes_little_endian(time);
-    return new_record_index;
+    blockchain_batch batch;
+    batch.put(point);
+    // Batches of puts alone are never rejected
+    return commit(batch)->front();
 }
 
-const uint8_t* blockchain::get(const output_index_type index) const
+output_record blockchain::get(const output_index_type index) const
 {
-    auto memory = records_->get(index);
-    const auto* buffer = memory->buffer();
-    return buffer;
+    // Shards grow unevenly, so some indexes below count() have no slot
+    output_record record;
+    if (!allocated(index))
+    {
+        record.point.fill(0);
+        record.time = 0;
+        return record;
+    }
+    return read_record(index);
 }
 
-void blockchain::remove(const output_index_type index)
+bool blockchain::remove(const output_index_type index)
 {
-    auto memory = records_->get(index);
-    auto* buffer = memory->buffer();
-    BITCOIN_ASSERT(buffer[0] == 2 || buffer[0] == 3);
-    buffer[0] = 0;
+    blockchain_batch batch;
+    batch.remove(index);
+    return static_cast<bool>(commit(batch));
 }
-bool blockchain::exists(const output_index_type index)
+
+// Every shard's record mappings, held for the length of one scan.
+class pinned_records
 {
-    auto memory = records_->get(index);
-    const auto* buffer = memory->buffer();
-    if (buffer[0] != 0)
+public:
+    pinned_records(const std::vector<std::unique_ptr<blockchain_shard>>&
+        shards, record_layout layout, bc::database::file_storage& live)
+      : layout_(layout), live_memory_(live.access()),
+        live_(live_memory_->buffer())
+    {
+        const bool dense = layout_ == record_layout::dense;
+        const auto record_size =
+            dense ? point_x_size : blockchain_record_size;
+        for (const auto& shard: shards)
+        {
+            view pinned;
+            pinned.memory = shard->records_storage->access();
+            pinned.records = pinned.memory->buffer() +
+                (dense ? points_offset : records_offset);
+            pinned.slots = shard->records->count();
+            pinned.end = pinned.records + pinned.slots * record_size;
+            if (dense)
+            {
+                pinned.time_memory = shard->time_storage->access();
+                pinned.times = pinned.time_memory->buffer() + records_offset;
+                pinned.parity_memory = shard->parity_storage->access();
+                pinned.parity = pinned.parity_memory->buffer();
+            }
+            advise_range(pinned.records, pinned.end, MADV_SEQUENTIAL);
+            views_.push_back(pinned);
+        }
+    }
+    ~pinned_records()
+    {
+        for (const auto& pinned: views_)
+            advise_range(pinned.records, pinned.end, MADV_NORMAL);
+    }
+
+    // Returns false for slots past the end of their shard.
+    bool read(const output_index_type index, output_record& record) const
     {
-        BITCOIN_ASSERT(buffer[0] == 2 || buffer[0] == 3);
+        const auto& pinned = views_[index % views_.size()];
+        const auto slot = index / views_.size();
+        if (slot >= pinned.slots)
+            return false;
+        if (layout_ == record_layout::classic)
+            record = decode_record(
+                pinned.records + slot * blockchain_record_size);
+        else
+        {
+            record = decode_record(pinned.records + slot * point_x_size,
+                test_bit(pinned.parity, slot),
+                pinned.times + slot * time_column_size);
+            if (!test_bit(live_, index))
+                record.point[0] = 0;
+        }
         return true;
     }
-    return false;
+
+    void prefetch(const output_index_type index) const
+    {
+        const auto& pinned = views_[index % views_.size()];
+        const auto slot = index / views_.size();
+        if (slot >= pinned.slots)
+            return;
+        if (layout_ == record_layout::classic)
+        {
+            __builtin_prefetch(pinned.records + slot * blockchain_record_size);
+            return;
+        }
+        __builtin_prefetch(pinned.records + slot * point_x_size);
+        __builtin_prefetch(pinned.times + slot * time_column_size);
+    }
+
+private:
+    struct view
+    {
+        bc::database::memory_ptr memory;
+        const uint8_t* records;
+        const uint8_t* end;
+        output_index_type slots;
+
+        // Dense layout only
+        bc::database::memory_ptr time_memory;
+        const uint8_t* times;
+        bc::database::memory_ptr parity_memory;
+        const uint8_t* parity;
+    };
+
+    const record_layout layout_;
+    std::vector<view> views_;
+    // Spent dense records read back with a zero prefix like classic ones
+    bc::database::memory_ptr live_memory_;
+    const uint8_t* live_;
+};
+
+void blockchain::for_each_live(output_index_type first,
+    output_index_type last, live_record_handler handler) const
+{
+    last = std::min(last, count());
+    if (first >= last)
+        return;
+
+    // Hold the remap locks once for the whole walk rather than per record
+    const pinned_records records(shards_, layout_, *live_storage_);
+    output_record record;
+    for_each_live_index(first, last,
+        [&](output_index_type index)
+    {
+        records.prefetch(index + scan_prefetch_distance);
+        if (records.read(index, record))
+            handler(index, record);
+    });
+}
+
+void blockchain::read_records(const output_index_list& indexes,
+    live_record_handler handler) const
+{
+    if (indexes.empty())
+        return;
+
+    const pinned_records records(shards_, layout_, *live_storage_);
+    output_record record;
+    for (size_t i = 0; i < indexes.size(); ++i)
+    {
+        if (i + scan_prefetch_distance < indexes.size())
+            records.prefetch(indexes[i + scan_prefetch_distance]);
+        if (records.read(indexes[i], record))
+            handler(indexes[i], record);
+    }
+}
+
+output_index_list blockchain::removed_after(generation_type generation,
+    output_index_type first, output_index_type last) const
+{
+    output_index_list result;
+    for (const auto& shard: shards_)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        for (const auto& pending: shard->pending_free)
+            if (pending.first > generation && pending.second >= first &&
+                pending.second < last)
+                result.push_back(pending.second);
+    }
+    return result;
+}
+
+// Ranges smaller than this are not worth a thread of their own.
+constexpr output_index_type verify_minimum_range = 4096;
+
+verify_report blockchain::verify(size_t threads, size_t report_limit) const
+{
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    const auto view = snapshot();
+    const auto total = view->count();
+    threads = std::max<size_t>(
+        std::min<size_t>(threads, total / verify_minimum_range), 1);
+
+    // Each thread streams one contiguous range over its own pinned
+    // mappings, so results merged in order give the lowest bad indexes.
+    std::vector<verify_report> reports(threads);
+    std::vector<std::thread> workers;
+    const auto span = (size_t(total) + threads - 1) / threads;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        const auto first = static_cast<output_index_type>(
+            std::min<size_t>(i * span, total));
+        const auto last = static_cast<output_index_type>(
+            std::min<size_t>(first + span, total));
+        auto& report = reports[i];
+        workers.emplace_back([&view, &report, first, last, report_limit]
+        {
+            secp256k1_pubkey key;
+            view->for_each_live(first, last,
+                [&](output_index_type index, const output_record& record)
+            {
+                ++report.checked;
+                const auto prefix = record.point[0];
+                const bool valid = (prefix == 2 || prefix == 3) &&
+                    parse_point(key, record.point);
+                if (!valid && report.bad.size() < report_limit)
+                    report.bad.push_back(index);
+            });
+        });
+    }
+    for (auto& worker: workers)
+        worker.join();
+
+    verify_report result;
+    for (const auto& report: reports)
+    {
+        result.checked += report.checked;
+        for (const auto index: report.bad)
+            if (result.bad.size() < report_limit)
+                result.bad.push_back(index);
+    }
+    return result;
+}
+
+void blockchain::rebuild_merkle_tree()
+{
+    merkle_leaf_list leaves;
+    for_each_live(0, count(),
+        [&leaves](output_index_type index, const output_record& record)
+    {
+        leaves.emplace_back(index, merkle_tree::leaf_hash(index, record));
+    });
+    merkle_ = std::make_unique<merkle_tree>();
+    merkle_->resize(count());
+    merkle_->update(leaves);
+}
+
+bcs::hash_digest blockchain::state_root() const
+{
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    return merkle_->root();
+}
+
+boost::optional<merkle_proof> blockchain::state_proof(
+    const output_index_type index) const
+{
+    std::lock_guard<std::mutex> lock(publish_mutex_);
+    if (index >= merkle_->size())
+        return boost::none;
+    return merkle_->prove(index);
+}
+
+snapshot_ptr blockchain::snapshot() const
+{
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    const auto generation = generation_.load(std::memory_order_acquire);
+    snapshots_.insert(generation);
+    return snapshot_ptr(new blockchain_snapshot(*this, generation, count()));
+}
+
+void blockchain::release_snapshot(generation_type generation) const
+{
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    snapshots_.erase(snapshots_.find(generation));
+}
+
+boost::optional<output_index_type> blockchain::find(
+    const bcs::ec_compressed& point) const
+{
+    const auto& shard = *shards_[shard_for(point)];
+    // Candidates share a 32 bit hash, so compare the actual records
+    for (const auto index: shard.index->candidates(point))
+        if (read_record(index).point == point)
+            return index;
+    return boost::none;
+}
+
+bool blockchain::exists(const output_index_type index)
+{
+    if (index >= count())
+        return false;
+    // Answered from the bitmap without touching the record page
+    auto memory = live_storage_->access();
+    const auto* words = reinterpret_cast<const live_word*>(memory->buffer());
+    const auto mask = live_word(1) << (index % live_word_bits);
+    return (words[index / live_word_bits] & mask) != 0;
 }
 
 output_index_type blockchain::count() const
 {
-    return records_->count();
+    // One past the highest allocated slot across the interleaved shards
+    output_index_type result = 0;
+    for (size_t i = 0; i < shards_.size(); ++i)
+    {
+        const auto slots = shards_[i]->records->count();
+        if (slots > 0)
+            result = std::max<output_index_type>(result,
+                (slots - 1) * shards_.size() + i + 1);
+    }
+    return result;
 }
 
-} // namespace
+output_index_type blockchain::live_count() const
+{
+    auto memory = live_storage_->access();
+    const auto* words = reinterpret_cast<const live_word*>(memory->buffer());
+    const auto words_count = live_words(count());
+
+    // Independent sums let the compiler vectorize or pipeline popcnt.
+    uint64_t sums[4] = { 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 4 <= words_count; i += 4)
+        for (size_t j = 0; j < 4; ++j)
+            sums[j] += __builtin_popcountll(words[i + j]);
+    for (; i < words_count; ++i)
+        sums[0] += __builtin_popcountll(words[i]);
+    return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+void blockchain::for_each_live_index(output_index_type first,
+    output_index_type last, live_index_handler handler) const
+{
+    last = std::min(last, count());
+    if (first >= last)
+        return;
+
+    auto memory = live_storage_->access();
+    const auto* words = reinterpret_cast<const live_word*>(memory->buffer());
+    const auto first_word = first / live_word_bits;
+    const auto last_word = live_words(last);
+    for (size_t i = first_word; i < last_word; ++i)
+    {
+        auto word = words[i];
+        if (i == first_word)
+            word &= ~live_word(0) << (first % live_word_bits);
+        while (word != 0)
+        {
+            const auto index = i * live_word_bits + __builtin_ctzll(word);
+            if (index >= last)
+                return;
+            handler(index);
+            word &= word - 1;
+        }
+    }
+}
+
+boost::optional<output_index_list> blockchain::commit(
+    const blockchain_batch& batch)
+{
+    output_index_list indexes;
+    if (batch.empty())
+        return indexes;
+
+    // Lock every shard the batch touches, in order to avoid deadlock
+    std::vector<size_t> touched;
+    for (const auto index: batch.removes_)
+        touched.push_back(shard_of(index));
+    for (const auto& point: batch.puts_)
+        touched.push_back(shard_for(point));
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const auto shard_index: touched)
+        locks.emplace_back(shards_[shard_index]->mutex);
+
+    // Removes are checked under the shard locks, so no other commit can
+    // spend them in between.
+    if (!removable(batch.removes_))
+        return boost::none;
+
+    const auto outputs = resolve_outputs(batch.puts_);
+
+    // The batch is journaled before it touches the outputs. Commit
+    // durability syncs the frame first, so a crash never leaves part of
+    // the batch applied. Other modes may lose the frame after some of
+    // its writes reached the disk, so the chain stays marked unclean
+    // until the next checkpoint and is repaired when opened unclean.
+    // Snapshots keep seeing the chain as it was until this is published.
+    uint32_t time;
+    const auto generation = append_journal(time, batch.removes_, outputs);
+
+    bcs::point_list removed_points;
+    for (const auto index: batch.removes_)
+    {
+        const auto point = read_record(index).point;
+        removed_points.push_back(point);
+        versions_->removed(index, generation, point[0]);
+        tombstone_record(index);
+        set_live(index, false);
+        shards_[shard_of(index)]->index->erase(point, index);
+    }
+
+    // Consume the spent slots picked by resolve_outputs()
+    std::vector<size_t> placed(shards_.size(), 0);
+    for (const auto& output: outputs)
+    {
+        auto& shard = *shards_[shard_of(output.index)];
+        ++placed[shard_of(output.index)];
+        const auto slot = slot_of(output.index);
+        if (slot < shard.freed.size())
+            shard.freed[slot] = false;
+    }
+    for (const auto shard_index: touched)
+    {
+        auto& shard = *shards_[shard_index];
+        const auto free_count = shard.free_records->count();
+        const auto reused = std::min<size_t>(free_count, placed[shard_index]);
+        shard.free_records->set_count(free_count - reused);
+        shard.free_records->commit();
+        if (placed[shard_index] > reused)
+            allocate_records(shard, placed[shard_index] - reused);
+    }
+    reserve_live_bitmap();
+
+    for (const auto& output: outputs)
+    {
+        write_record(output.index, output.point, time);
+        set_live(output.index, true);
+        shards_[shard_of(output.index)]->index->insert(
+            output.point, output.index);
+        versions_->reserve(output.index + 1);
+        versions_->created(output.index, generation);
+        indexes.push_back(output.index);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sum_mutex_);
+        auto memory = sum_storage_->access();
+        for (const auto& point: removed_points)
+            add_to_sum(memory->buffer(), point, true);
+        for (const auto& output: outputs)
+            add_to_sum(memory->buffer(), output.point, false);
+    }
+
+    // Leaves are hashed here, only their paths inside publish()
+    merkle_leaf_list leaves;
+    for (const auto index: batch.removes_)
+        leaves.emplace_back(index, bcs::null_hash);
+    for (const auto& output: outputs)
+        leaves.emplace_back(output.index,
+            merkle_tree::leaf_hash(output.index, { output.point, time }));
+    publish(generation, leaves);
+
+    for (const auto index: batch.removes_)
+        shards_[shard_of(index)]->pending_free.emplace_back(
+            generation, index);
+    for (const auto shard_index: touched)
+        release_pending_records(*shards_[shard_index]);
+
+    locks.clear();
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex_);
+        full = journal_end_ >= journal_checkpoint_size;
+    }
+    if (full)
+        checkpoint();
+    return indexes;
+}
+
+bool blockchain::removable(const output_index_list& removes) const
+{
+    auto sorted = removes;
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+        return false;
+
+    for (const auto index: sorted)
+        if (!allocated(index) || !live(index))
+            return false;
+    return true;
+}
+
+void blockchain::publish(generation_type generation,
+    const merkle_leaf_list& leaves)
+{
+    // Commits on other shards may have journaled earlier and not yet
+    // finished applying. Publish strictly in journal order.
+    std::unique_lock<std::mutex> lock(publish_mutex_);
+    publish_condition_.wait(lock, [this, generation]
+    {
+        return generation_.load() + 1 == generation;
+    });
+    merkle_->update(leaves);
+    generation_.store(generation, std::memory_order_release);
+    publish_condition_.notify_all();
+}
+
+generation_type blockchain::append_journal(uint32_t& time,
+    const output_index_list& removes, const staged_output_list& puts)
+{
+    const auto body_size = sizeof(uint64_t) + 4 +
+        4 + removes.size() * 4 +
+        4 + puts.size() * (4 + bcs::ec_compressed_size);
+    bcs::data_chunk body(body_size);
+    auto serial = bcs::make_unsafe_serializer(body.begin());
+    // The sequence and time are written once the frame's position is known
+    serial.skip(sizeof(uint64_t) + 4);
+    serial.write_4_bytes_little_endian(removes.size());
+    for (const auto index: removes)
+        serial.write_4_bytes_little_endian(index);
+    serial.write_4_bytes_little_endian(puts.size());
+    for (const auto& output: puts)
+    {
+        serial.write_4_bytes_little_endian(output.index);
+        serial.write_bytes(output.point);
+    }
+
+    generation_type generation;
+    {
+        std::lock_guard<std::mutex> lock(journal_mutex_);
+        // Synced once per checkpoint, before the first commit after it
+        // writes anything else.
+        set_clean(false);
+        // Commit times never go backwards, keeping the time index sorted
+        time = std::max<uint32_t>(std::time(nullptr), journal_time_);
+        journal_time_ = time;
+        auto sequence = bcs::make_unsafe_serializer(body.begin());
+        sequence.write_8_bytes_little_endian(journal_sequence_);
+        sequence.write_4_bytes_little_endian(time);
+        const auto checksum = bcs::sha256_hash(body);
+
+        const auto frame_size = 4 + body_size + bcs::hash_size;
+        auto memory = journal_storage_->reserve(journal_end_ + frame_size);
+        auto frame = bcs::make_unsafe_serializer(
+            memory->buffer() + journal_end_);
+        frame.write_4_bytes_little_endian(body_size);
+        frame.write_bytes(body);
+        frame.write_hash(checksum);
+
+        memory.reset();
+
+        journal_end_ += frame_size;
+        ++journal_sequence_;
+        generation = ++journal_generation_;
+        append_times(time, puts);
+    }
+
+    journal_written(removes.size() + puts.size());
+    return generation;
+}
+
+void blockchain::journal_written(size_t records)
+{
+    std::unique_lock<std::mutex> lock(durability_mutex_);
+    switch (durability_.mode)
+    {
+        case durability_mode::none:
+            return;
+        case durability_mode::group:
+            unflushed_records_ += records;
+            if (unflushed_records_ < durability_.records)
+                return;
+            unflushed_records_ = 0;
+            break;
+        case durability_mode::commit:
+            break;
+    }
+    lock.unlock();
+    // Flushing syncs every frame written so far, so commits racing on
+    // other shards share the cost.
+    flush_journal();
+}
 
+void blockchain::flush_journal()
+{
+    const auto start = std::chrono::steady_clock::now();
+    journal_storage_->flush();
+    const uint64_t elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(durability_mutex_);
+    ++flush_stats_.flushes;
+    flush_stats_.total_microseconds += elapsed;
+    flush_stats_.max_microseconds =
+        std::max(flush_stats_.max_microseconds, elapsed);
+}
+
+void blockchain::set_durability(const durability_policy& policy)
+{
+    stop_flusher();
+    {
+        std::lock_guard<std::mutex> lock(durability_mutex_);
+        durability_ = policy;
+        stopping_ = false;
+    }
+    if (policy.mode == durability_mode::group)
+        flusher_ = std::thread([this] { run_flusher(); });
+}
+
+durability_policy blockchain::durability() const
+{
+    std::lock_guard<std::mutex> lock(durability_mutex_);
+    return durability_;
+}
+
+flush_stats blockchain::journal_flush_stats() const
+{
+    std::lock_guard<std::mutex> lock(durability_mutex_);
+    return flush_stats_;
+}
+
+size_t blockchain::checkpoints() const
+{
+    return checkpoints_;
+}
+
+void blockchain::run_flusher()
+{
+    std::unique_lock<std::mutex> lock(durability_mutex_);
+    while (!stopping_)
+    {
+        durability_condition_.wait_for(lock,
+            std::chrono::milliseconds(durability_.interval_ms));
+        if (unflushed_records_ == 0)
+            continue;
+        unflushed_records_ = 0;
+        lock.unlock();
+        flush_journal();
+        lock.lock();
+    }
+}
+
+void blockchain::stop_flusher()
+{
+    {
+        std::lock_guard<std::mutex> lock(durability_mutex_);
+        stopping_ = true;
+    }
+    durability_condition_.notify_all();
+    if (flusher_.joinable())
+        flusher_.join();
+}
+
+void blockchain::recover_journal()
+{
+    std::vector<bcs::data_chunk> frames;
+    {
+        auto memory = journal_storage_->access();
+        const auto* buffer = memory->buffer();
+        const auto size = journal_storage_->logical();
+        BITCOIN_ASSERT(size >= journal_header_size);
+
+        auto header = bcs::make_unsafe_deserializer(buffer);
+        journal_sequence_ = header.read_8_bytes_little_endian();
+        journal_end_ = journal_header_size;
+
+        // Stop at the first torn, corrupt or stale frame
+        while (journal_end_ + 4 <= size)
+        {
+            auto frame = bcs::make_unsafe_deserializer(buffer + journal_end_);
+            const size_t body_size = frame.read_4_bytes_little_endian();
+            const auto frame_size = 4 + body_size + bcs::hash_size;
+            if (body_size < sizeof(uint64_t) ||
+                journal_end_ + frame_size > size)
+                break;
+
+            const auto* body = buffer + journal_end_ + 4;
+            const bcs::data_slice body_slice(body, body + body_size);
+            auto check = bcs::make_unsafe_deserializer(body + body_size);
+            if (bcs::sha256_hash(body_slice) != check.read_hash())
+                break;
+            auto sequence = bcs::make_unsafe_deserializer(body);
+            if (sequence.read_8_bytes_little_endian() != journal_sequence_)
+                break;
+
+            frames.emplace_back(body_slice.begin(), body_slice.end());
+            journal_end_ += frame_size;
+            ++journal_sequence_;
+        }
+    }
+
+    // Outside commit durability an unsynced frame may be lost while
+    // some of its writes reached the other files, so those are rebuilt.
+    if (frames.empty() && clean_)
+    {
+        journal_end_ = journal_header_size;
+        return;
+    }
+
+    // A crash may leave slots allocated past the end of the live bitmap
+    reserve_live_bitmap();
+
+    // Replaying is idempotent since every put carries its index.
+    for (const auto& body: frames)
+    {
+        auto deserial = bcs::make_unsafe_deserializer(
+            body.begin() + sizeof(uint64_t));
+        const auto time = deserial.read_4_bytes_little_endian();
+
+        const auto removes_count = deserial.read_4_bytes_little_endian();
+        for (size_t i = 0; i < removes_count; ++i)
+        {
+            const auto index = deserial.read_4_bytes_little_endian();
+            if (allocated(index))
+            {
+                tombstone_record(index);
+                set_live(index, false);
+            }
+        }
+
+        const auto puts_count = deserial.read_4_bytes_little_endian();
+        for (size_t i = 0; i < puts_count; ++i)
+        {
+            const auto index = deserial.read_4_bytes_little_endian();
+            const auto point = deserial.read_forward<bcs::ec_compressed_size>();
+            auto& shard = *shards_[shard_of(index)];
+            auto& records = *shard.records;
+            if (slot_of(index) >= records.count())
+            {
+                allocate_records(shard, slot_of(index) + 1 - records.count());
+                reserve_live_bitmap();
+            }
+            write_record(index, point, time);
+            set_live(index, true);
+        }
+    }
+
+    std::cerr << "blockchain: replayed " << frames.size()
+        << " journal frames" << (clean_ ? "" : " after an unclean close")
+        << std::endl;
+    // Classic records also carry their liveness, so trust those instead
+    if (layout_ == record_layout::classic)
+        rebuild_live_bitmap();
+    rebuild_commitment_index();
+    rebuild_free_records();
+    rebuild_commitment_sum();
+    rebuild_time_index();
+    checkpoint();
+}
+
+void blockchain::checkpoint()
+{
+    // Wait out every commit in flight
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto& shard: shards_)
+        locks.emplace_back(shard->mutex);
+    std::lock_guard<std::mutex> lock(journal_mutex_);
+
+    for (auto& shard: shards_)
+    {
+        shard->records->commit();
+        shard->free_records->commit();
+        shard->records_storage->flush();
+        if (layout_ == record_layout::dense)
+        {
+            shard->time_column->commit();
+            shard->time_storage->flush();
+            shard->parity_storage->flush();
+        }
+        shard->index->flush();
+        shard->free_storage->flush();
+    }
+    live_storage_->flush();
+    sum_storage_->flush();
+
+    // Spent outputs leave their entries behind in the time index
+    const auto entries_count = times_->count();
+    if (entries_count > time_compact_minimum &&
+        entries_count > 2 * live_count())
+        rebuild_time_index();
+    times_storage_->flush();
+
+    // Frames older than the base sequence are ignored by recovery.
+    auto memory = journal_storage_->access();
+    auto serial = bcs::make_unsafe_serializer(memory->buffer());
+    serial.write_8_bytes_little_endian(journal_sequence_);
+    memory.reset();
+    journal_storage_->flush();
+    journal_end_ = journal_header_size;
+    set_clean(true);
+    ++checkpoints_;
+}
+
+void blockchain::set_clean(bool clean)
+{
+    if (clean_ == clean)
+        return;
+    auto memory = clean_storage_->access();
+    memory->buffer()[0] = clean ? 1 : 0;
+    memory.reset();
+    clean_storage_->flush();
+    clean_ = clean;
+}
+
+} // namespace
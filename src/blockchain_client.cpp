@@ -2,10 +2,10 @@
 
 namespace dark {
 
-blockchain_client::blockchain_client()
+blockchain_client::blockchain_client(const std::string& endpoint)
 {
     socket_ = zsock_new(ZMQ_REQ);
-    zsock_connect(socket_, "tcp://localhost:8887");
+    zsock_connect(socket_, "%s", endpoint.c_str());
 }
 blockchain_client::~blockchain_client()
 {
@@ -33,12 +33,13 @@ get_result blockchain_client::get(const output_index_type index)
     return { result, deserial.read_4_bytes_little_endian() };
 }
 
-void blockchain_client::remove(const output_index_type index)
+bool blockchain_client::remove(const output_index_type index)
 {
     send_request(blockchain_server_command::remove, index);
 
     auto response_data = receive_response();
-    BITCOIN_ASSERT(response_data.empty());
+    BITCOIN_ASSERT(response_data.size() == 1);
+    return response_data[0] != 0;
 }
 bool blockchain_client::exists(const output_index_type index)
 {
@@ -49,6 +50,88 @@ bool blockchain_client::exists(const output_index_type index)
     return deserial.read_4_bytes_little_endian();
 }
 
+get_many_result_list blockchain_client::get_many(
+    const output_index_list& indexes)
+{
+    send_request(blockchain_server_command::get_many, indexes);
+
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() ==
+        get_many_record_size * indexes.size());
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    get_many_result_list results(indexes.size());
+    for (auto& result: results)
+    {
+        result.live = deserial.read_byte() != 0;
+        result.point = deserial.read_forward<bcs::ec_compressed_size>();
+        result.time = deserial.read_4_bytes_little_endian();
+    }
+    return results;
+}
+std::vector<bool> blockchain_client::exists_many(
+    const output_index_list& indexes)
+{
+    send_request(blockchain_server_command::exists_many, indexes);
+
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() == indexes.size());
+    std::vector<bool> results(indexes.size());
+    for (size_t i = 0; i < results.size(); ++i)
+        results[i] = response_data[i] != 0;
+    return results;
+}
+
+boost::optional<output_index_type> blockchain_client::find(
+    const bcs::ec_compressed& point)
+{
+    send_request(blockchain_server_command::find, point);
+
+    auto response_data = receive_response();
+    if (response_data.empty())
+        return boost::none;
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    return deserial.read_4_bytes_little_endian();
+}
+
+scan_frame blockchain_client::scan(output_index_type cursor,
+    uint32_t limit)
+{
+    bcs::data_chunk data(8);
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_4_bytes_little_endian(cursor);
+    serial.write_4_bytes_little_endian(limit);
+    send_request(blockchain_server_command::scan, data);
+
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() >= 4);
+    BITCOIN_ASSERT((response_data.size() - 4) % scan_record_size == 0);
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    scan_frame frame;
+    frame.next = deserial.read_4_bytes_little_endian();
+    const auto size = (response_data.size() - 4) / scan_record_size;
+    frame.indexes.resize(size);
+    frame.records.resize(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        frame.indexes[i] = deserial.read_4_bytes_little_endian();
+        frame.records[i].point =
+            deserial.read_forward<bcs::ec_compressed_size>();
+        frame.records[i].time = deserial.read_4_bytes_little_endian();
+    }
+    return frame;
+}
+void blockchain_client::scan(live_record_handler handler, uint32_t limit)
+{
+    output_index_type cursor = 0;
+    while (cursor != scan_complete)
+    {
+        const auto frame = scan(cursor, limit);
+        for (size_t i = 0; i < frame.indexes.size(); ++i)
+            handler(frame.indexes[i], frame.records[i]);
+        cursor = frame.next;
+    }
+}
+
 output_index_type blockchain_client::count()
 {
     send_request(blockchain_server_command::count, bcs::data_chunk());
@@ -58,6 +141,122 @@ output_index_type blockchain_client::count()
     return deserial.read_4_bytes_little_endian();
 }
 
+output_index_type blockchain_client::live_count()
+{
+    send_request(blockchain_server_command::live_count, bcs::data_chunk());
+
+    auto response_data = receive_response();
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    return deserial.read_4_bytes_little_endian();
+}
+
+boost::optional<bcs::ec_compressed> blockchain_client::commitment_sum()
+{
+    send_request(blockchain_server_command::commitment_sum,
+        bcs::data_chunk());
+
+    auto response_data = receive_response();
+    if (response_data.empty())
+        return boost::none;
+    BITCOIN_ASSERT(response_data.size() == bcs::ec_compressed_size);
+    bcs::ec_compressed sum;
+    std::copy(response_data.begin(), response_data.end(), sum.begin());
+    return sum;
+}
+
+flush_stats blockchain_client::journal_flush_stats()
+{
+    send_request(blockchain_server_command::flush_stats, bcs::data_chunk());
+
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() == 3 * 8);
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    flush_stats stats;
+    stats.flushes = deserial.read_8_bytes_little_endian();
+    stats.total_microseconds = deserial.read_8_bytes_little_endian();
+    stats.max_microseconds = deserial.read_8_bytes_little_endian();
+    return stats;
+}
+
+output_index_list blockchain_client::time_range(uint32_t from, uint32_t to)
+{
+    bcs::data_chunk data(8);
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_4_bytes_little_endian(from);
+    serial.write_4_bytes_little_endian(to);
+    send_request(blockchain_server_command::time_range, data);
+    return receive_indexes();
+}
+
+output_index_list blockchain_client::newest(uint32_t count)
+{
+    send_request(blockchain_server_command::newest, count);
+    return receive_indexes();
+}
+
+verify_report blockchain_client::verify()
+{
+    send_request(blockchain_server_command::verify, bcs::data_chunk());
+
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() >= 4);
+    BITCOIN_ASSERT(response_data.size() % 4 == 0);
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    verify_report report;
+    report.checked = deserial.read_4_bytes_little_endian();
+    report.bad.resize(response_data.size() / 4 - 1);
+    for (auto& index: report.bad)
+        index = deserial.read_4_bytes_little_endian();
+    return report;
+}
+
+bool blockchain_client::export_snapshot(const std::string& name)
+{
+    const bcs::data_chunk data(name.begin(), name.end());
+    send_request(blockchain_server_command::export_snapshot, data);
+
+    auto response_data = receive_response();
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    return deserial.read_4_bytes_little_endian();
+}
+
+std::string blockchain_client::stats()
+{
+    send_request(blockchain_server_command::stats, bcs::data_chunk());
+
+    const auto response_data = receive_response();
+    return std::string(response_data.begin(), response_data.end());
+}
+
+bcs::hash_digest blockchain_client::state_root()
+{
+    send_request(blockchain_server_command::state_root, bcs::data_chunk());
+
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() == bcs::hash_size);
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    return deserial.read_hash();
+}
+
+boost::optional<merkle_proof> blockchain_client::state_proof(
+    const output_index_type index)
+{
+    send_request(blockchain_server_command::state_proof, index);
+
+    auto response_data = receive_response();
+    if (response_data.empty())
+        return boost::none;
+    BITCOIN_ASSERT(response_data.size() % bcs::hash_size == 0);
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    merkle_proof proof;
+    proof.index = index;
+    proof.root = deserial.read_hash();
+    proof.siblings.resize(response_data.size() / bcs::hash_size - 1);
+    for (auto& sibling: proof.siblings)
+        sibling = deserial.read_hash();
+    return proof;
+}
+
 void blockchain_client::send_request(blockchain_server_command command,
     bcs::data_slice data)
 {
@@ -90,6 +289,16 @@ void blockchain_client::send_request(
     send_request(command, data);
 }
 
+void blockchain_client::send_request(blockchain_server_command command,
+    const output_index_list& indexes)
+{
+    bcs::data_chunk data(4 * indexes.size());
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    for (const auto index: indexes)
+        serial.write_4_bytes_little_endian(index);
+    send_request(command, data);
+}
+
 bcs::data_chunk blockchain_client::receive_response()
 {
     zmsg_t* message = zmsg_recv(socket_);
@@ -109,5 +318,16 @@ bcs::data_chunk blockchain_client::receive_response()
     return result;
 }
 
+output_index_list blockchain_client::receive_indexes()
+{
+    auto response_data = receive_response();
+    BITCOIN_ASSERT(response_data.size() % 4 == 0);
+    output_index_list indexes(response_data.size() / 4);
+    auto deserial = bcs::make_unsafe_deserializer(response_data.begin());
+    for (auto& index: indexes)
+        index = deserial.read_4_bytes_little_endian();
+    return indexes;
+}
+
 } // namespace dark
 
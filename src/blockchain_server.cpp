@@ -1,39 +1,132 @@
 #include <dark/blockchain_server.hpp>
 
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <dark/blockchain_snapshot.hpp>
+#include <dark/logger.hpp>
+
 namespace dark {
 
-blockchain_server::blockchain_server()
+// Where the front end hands requests to the workers
+constexpr char workers_endpoint[] = "inproc://blockchain_workers";
+
+// Metric labels by command number, 0 for unknown commands
+const char* const command_names[] =
+{
+    "unknown", "put", "get", "remove", "exists", "count", "live_count",
+    "find", "commitment_sum", "flush_stats", "time_range", "newest",
+    "verify", "export_snapshot", "state_root", "state_proof", "get_many",
+    "exists_many", "scan", "stats"
+};
+
+// Clients name a file inside the snapshots directory, never a path.
+bool valid_snapshot_name(const std::string& name)
+{
+    return !name.empty() && name.find('/') == std::string::npos &&
+        name.find("..") == std::string::npos &&
+        name.find('\0') == std::string::npos;
+}
+
+// Batched requests are packed [index:4] lists.
+output_index_list read_indexes(const bcs::data_chunk& data)
 {
-    socket_ = zsock_new(ZMQ_REP);
-    zsock_bind(socket_, "tcp://*:8887");
+    BITCOIN_ASSERT(data.size() % 4 == 0);
+    output_index_list indexes(data.size() / 4);
+    auto deserial = bcs::make_unsafe_deserializer(data.begin());
+    for (auto& index: indexes)
+        index = deserial.read_4_bytes_little_endian();
+    return indexes;
+}
+
+blockchain_server::blockchain_server(size_t shards, record_layout layout,
+    size_t workers, const std::string& bind,
+    const std::string& kernels_directory,
+    const std::string& snapshots_directory)
+  : chain_("blockchain", shards, layout), kernels_(kernels_directory),
+    snapshots_directory_(snapshots_directory),
+    sequencer_(chain_),
+    workers_count_(workers == 0 ?
+        std::max(std::thread::hardware_concurrency(), 1u) : workers),
+    in_flight_(server_metrics().gauge_for("blockchain_requests_in_flight"))
+{
+    sequencer_.set_commit_handler([this](
+        const sequenced_batch_list& committed)
+    {
+        journal_commit(committed);
+        for (const auto& item: committed)
+            feed_.publish(item, commit_time(item));
+    });
+
+    for (const auto name: command_names)
+        command_time_.push_back(&server_metrics().histogram_for(
+            "blockchain_request_microseconds",
+            std::string("command=\"") + name + "\""));
+
+    frontend_ = zsock_new(ZMQ_ROUTER);
+    bind_endpoints(frontend_, bind);
+
+    backend_ = zsock_new(ZMQ_DEALER);
+    zsock_bind(backend_, workers_endpoint);
 }
 blockchain_server::~blockchain_server()
 {
-    zsock_destroy(&socket_);
+    zsock_destroy(&frontend_);
+    zsock_destroy(&backend_);
 }
 
 void blockchain_server::start()
 {
     zsys_handler_set(NULL);
-    while (true)
-    {
-        auto request = receive();
+    for (size_t i = 0; i < workers_count_; ++i)
+        workers_.emplace_back([this] { run_worker(); });
 
-        reply(request);
+    // Spreads requests over idle workers and routes each reply back to
+    // its client. Returns once the context is terminated.
+    zmq_proxy(zsock_resolve(frontend_), zsock_resolve(backend_), NULL);
+
+    for (auto& worker: workers_)
+        worker.join();
+    workers_.clear();
+}
+
+void blockchain_server::run_worker()
+{
+    zsock_t* socket = zsock_new(ZMQ_REP);
+    zsock_connect(socket, "%s", workers_endpoint);
+
+    blockchain_server_request request;
+    while (receive(socket, request))
+    {
+        auto number = static_cast<size_t>(request.command);
+        if (number >= command_time_.size())
+            number = 0;
+        ++in_flight_;
+        {
+            scoped_timer timer(*command_time_[number]);
+            reply(socket, request);
+        }
+        --in_flight_;
     }
+
+    zsock_destroy(&socket);
 }
 
 dark::blockchain& blockchain_server::chain()
 {
     return chain_;
 }
-
-blockchain_server_request blockchain_server::receive()
+chain_sequencer& blockchain_server::sequencer()
 {
-    blockchain_server_request request;
+    return sequencer_;
+}
 
-    zmsg_t* message = zmsg_recv(socket_);
-    assert(message);
+bool blockchain_server::receive(zsock_t* socket,
+    blockchain_server_request& request)
+{
+    zmsg_t* message = zmsg_recv(socket);
+    // Interrupted or shutting down
+    if (!message)
+        return false;
     assert(zmsg_size(message) == 2);
 
     zframe_t* frame = zmsg_pop(message);
@@ -53,10 +146,11 @@ blockchain_server_request blockchain_server::receive()
 
     zmsg_destroy(&message);
 
-    return request;
+    return true;
 }
 
-void blockchain_server::reply(const blockchain_server_request& request)
+void blockchain_server::reply(zsock_t* socket,
+    const blockchain_server_request& request)
 {
     switch (request.command)
     {
@@ -66,12 +160,11 @@ void blockchain_server::reply(const blockchain_server_request& request)
             BITCOIN_ASSERT(request.data.size() == bcs::ec_compressed_size);
             bcs::ec_compressed point;
             std::copy(request.data.begin(), request.data.end(), point.begin());
-            // Blockchain call
-            auto index = chain_.put(point);
-            std::cout << "put(" << bcs::encode_base16(point) << ") -> "
-                << index << std::endl;
+            // Blockchain call, queued behind any other mutation
+            auto index = sequencer_.put(point);
+            server_log().debug("put(%x) -> %u", point, index);
             // Send response
-            respond(index);
+            respond(socket, index);
             break;
         }
         case blockchain_server_command::get:
@@ -80,13 +173,12 @@ void blockchain_server::reply(const blockchain_server_request& request)
             BITCOIN_ASSERT(request.data.size() == 4);
             auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
             auto index = deserial.read_4_bytes_little_endian();
-            // Blockchain call
-            auto result = chain_.get(index);
-            bcs::data_slice slice(result, result + blockchain_record_size);
-            std::cout << "get(" << index << ") -> "
-                << bcs::encode_base16(slice) << std::endl;
+            // Blockchain call, never seeing half of a message_server commit
+            auto result = chain_.snapshot()->get(index);
+            server_log().debug("get(%u) -> %x %u", index, result.point,
+                result.time);
             // Send response
-            respond(slice);
+            respond(socket, result);
             break;
         }
         case blockchain_server_command::remove:
@@ -95,11 +187,14 @@ void blockchain_server::reply(const blockchain_server_request& request)
             BITCOIN_ASSERT(request.data.size() == 4);
             auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
             auto index = deserial.read_4_bytes_little_endian();
-            // Blockchain call
-            chain_.remove(index);
-            std::cout << "remove(" << index << ")" << std::endl;
+            // Blockchain call, queued behind any other mutation
+            const bool removed = sequencer_.remove(index);
+            if (removed)
+                server_log().debug("remove(%u)", index);
+            else
+                server_log().info("remove(%u) rejected, not unspent", index);
             // Send response
-            respond(bcs::data_chunk());
+            respond(socket, bcs::data_chunk{ uint8_t(removed ? 1 : 0) });
             break;
         }
         case blockchain_server_command::exists:
@@ -109,10 +204,10 @@ void blockchain_server::reply(const blockchain_server_request& request)
             auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
             auto index = deserial.read_4_bytes_little_endian();
             // Blockchain call
-            bool exists = chain_.exists(index);
-            std::cout << "exists(" << index << ") -> " << exists << std::endl;
+            bool exists = chain_.snapshot()->exists(index);
+            server_log().debug("exists(%u) -> %u", index, exists);
             // Send response
-            respond(exists ? 1 : 0);
+            respond(socket, exists ? 1 : 0);
             break;
         }
         case blockchain_server_command::count:
@@ -121,17 +216,334 @@ void blockchain_server::reply(const blockchain_server_request& request)
             BITCOIN_ASSERT(request.data.empty());
             // Blockchain call
             auto count = chain_.count();
-            std::cout << "count() -> " << count << std::endl;
+            server_log().debug("count() -> %u", count);
+            // Send response
+            respond(socket, count);
+            break;
+        }
+        case blockchain_server_command::live_count:
+        {
+            // No request arguments for this call
+            BITCOIN_ASSERT(request.data.empty());
+            // Blockchain call
+            auto count = chain_.live_count();
+            server_log().debug("live_count() -> %u", count);
+            // Send response
+            respond(socket, count);
+            break;
+        }
+        case blockchain_server_command::find:
+        {
+            // Deserialize request arguments
+            BITCOIN_ASSERT(request.data.size() == bcs::ec_compressed_size);
+            bcs::ec_compressed point;
+            std::copy(request.data.begin(), request.data.end(), point.begin());
+            // Blockchain call
+            auto index = chain_.find(point);
+            if (index)
+                server_log().debug("find(%x) -> %u", point, *index);
+            else
+                server_log().debug("find(%x) -> none", point);
+            // Send response, empty when the point is not on chain
+            if (index)
+                respond(socket, *index);
+            else
+                respond(socket, bcs::data_chunk());
+            break;
+        }
+        case blockchain_server_command::commitment_sum:
+        {
+            // No request arguments for this call
+            BITCOIN_ASSERT(request.data.empty());
+            // Blockchain call
+            auto sum = chain_.commitment_sum();
+            if (sum)
+                server_log().debug("commitment_sum() -> %x", *sum);
+            else
+                server_log().debug("commitment_sum() -> none");
+            // Send response, empty when there are no unspent outputs
+            if (sum)
+                respond(socket, *sum);
+            else
+                respond(socket, bcs::data_chunk());
+            break;
+        }
+        case blockchain_server_command::flush_stats:
+        {
+            // No request arguments for this call
+            BITCOIN_ASSERT(request.data.empty());
+            // Blockchain call
+            const auto stats = chain_.journal_flush_stats();
+            server_log().debug("flush_stats() -> %u %u %u", stats.flushes,
+                stats.total_microseconds, stats.max_microseconds);
+            // Send response
+            bcs::data_chunk data(3 * 8);
+            auto serial = bcs::make_unsafe_serializer(data.begin());
+            serial.write_8_bytes_little_endian(stats.flushes);
+            serial.write_8_bytes_little_endian(stats.total_microseconds);
+            serial.write_8_bytes_little_endian(stats.max_microseconds);
+            respond(socket, data);
+            break;
+        }
+        case blockchain_server_command::time_range:
+        {
+            // Deserialize request arguments
+            BITCOIN_ASSERT(request.data.size() == 8);
+            auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
+            const auto from = deserial.read_4_bytes_little_endian();
+            const auto to = deserial.read_4_bytes_little_endian();
+            // Blockchain call
+            const auto indexes = chain_.snapshot()->created_between(from, to);
+            server_log().debug("time_range(%u, %u) -> %u outputs", from, to,
+                indexes.size());
+            // Send response
+            respond(socket, indexes);
+            break;
+        }
+        case blockchain_server_command::newest:
+        {
+            // Deserialize request arguments
+            BITCOIN_ASSERT(request.data.size() == 4);
+            auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
+            const auto count = deserial.read_4_bytes_little_endian();
+            // Blockchain call
+            const auto indexes = chain_.snapshot()->newest(count);
+            server_log().debug("newest(%u) -> %u outputs", count,
+                indexes.size());
+            // Send response
+            respond(socket, indexes);
+            break;
+        }
+        case blockchain_server_command::verify:
+        {
+            // Blockchain call
+            const auto report = chain_.verify();
+            server_log().info("verify() -> %u checked, %u bad",
+                report.checked, report.bad.size());
+            // Send response
+            bcs::data_chunk data(4 + 4 * report.bad.size());
+            auto serial = bcs::make_unsafe_serializer(data.begin());
+            serial.write_4_bytes_little_endian(report.checked);
+            for (const auto index: report.bad)
+                serial.write_4_bytes_little_endian(index);
+            respond(socket, data);
+            break;
+        }
+        case blockchain_server_command::export_snapshot:
+        {
+            // Deserialize request arguments
+            const std::string name(request.data.begin(), request.data.end());
+            bool written = false;
+            if (valid_snapshot_name(name))
+            {
+                boost::filesystem::create_directories(snapshots_directory_);
+                const auto path = (boost::filesystem::path(
+                    snapshots_directory_) / name).string();
+                // Blockchain call
+                written = chain_.snapshot()->write_file(path);
+            }
+            server_log().info("export_snapshot(%s) -> %u", name, written);
+            // Send response
+            respond(socket, written ? 1 : 0);
+            break;
+        }
+        case blockchain_server_command::state_root:
+        {
+            // Blockchain call
+            const auto root = chain_.state_root();
+            server_log().debug("state_root() -> %x", root);
+            // Send response
+            respond(socket, root);
+            break;
+        }
+        case blockchain_server_command::state_proof:
+        {
+            // Deserialize request arguments
+            BITCOIN_ASSERT(request.data.size() == 4);
+            auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
+            const auto index = deserial.read_4_bytes_little_endian();
+            // Blockchain call
+            const auto proof = chain_.state_proof(index);
+            server_log().debug("state_proof(%u) -> %u siblings", index,
+                proof ? proof->siblings.size() : 0);
+            // Send response, empty if the slot was never allocated
+            if (!proof)
+            {
+                respond(socket, bcs::data_chunk());
+                break;
+            }
+            const auto hashes = 1 + proof->siblings.size();
+            bcs::data_chunk data(bcs::hash_size * hashes);
+            auto serial = bcs::make_unsafe_serializer(data.begin());
+            serial.write_hash(proof->root);
+            for (const auto& sibling: proof->siblings)
+                serial.write_hash(sibling);
+            respond(socket, data);
+            break;
+        }
+        case blockchain_server_command::get_many:
+        {
+            // Deserialize request arguments
+            const auto indexes = read_indexes(request.data);
+            // Blockchain call, every record from the same commit
+            const auto view = chain_.snapshot();
+            bcs::data_chunk data(get_many_record_size * indexes.size(), 0);
+            auto serial = bcs::make_unsafe_serializer(data.begin());
+            for (const auto index: indexes)
+            {
+                if (!view->exists(index))
+                {
+                    serial.skip(get_many_record_size);
+                    continue;
+                }
+                const auto record = view->get(index);
+                serial.write_byte(1);
+                serial.write_bytes(record.point);
+                serial.write_4_bytes_little_endian(record.time);
+            }
+            server_log().debug("get_many(%u outputs)", indexes.size());
+            // Send response
+            respond(socket, data);
+            break;
+        }
+        case blockchain_server_command::exists_many:
+        {
+            // Deserialize request arguments
+            const auto indexes = read_indexes(request.data);
+            // Blockchain call
+            const auto view = chain_.snapshot();
+            bcs::data_chunk data(indexes.size());
+            for (size_t i = 0; i < indexes.size(); ++i)
+                data[i] = view->exists(indexes[i]) ? 1 : 0;
+            server_log().debug("exists_many(%u outputs)", indexes.size());
+            // Send response, one byte per index
+            respond(socket, data);
+            break;
+        }
+        case blockchain_server_command::scan:
+        {
+            // Deserialize request arguments
+            BITCOIN_ASSERT(request.data.size() == 8);
+            auto deserial = bcs::make_unsafe_deserializer(request.data.begin());
+            const auto cursor = deserial.read_4_bytes_little_endian();
+            const auto limit = deserial.read_4_bytes_little_endian();
+            // Blockchain call
+            output_index_list indexes;
+            std::vector<output_record> records;
+            const auto next = chain_.snapshot()->scan(cursor, limit, indexes,
+                records);
+            server_log().debug("scan(%u) -> %u outputs", cursor,
+                records.size());
+            // Send response
+            bcs::data_chunk data(4 + scan_record_size * records.size());
+            auto serial = bcs::make_unsafe_serializer(data.begin());
+            serial.write_4_bytes_little_endian(next);
+            for (size_t i = 0; i < records.size(); ++i)
+            {
+                serial.write_4_bytes_little_endian(indexes[i]);
+                serial.write_bytes(records[i].point);
+                serial.write_4_bytes_little_endian(records[i].time);
+            }
+            respond(socket, data);
+            break;
+        }
+        case blockchain_server_command::stats:
+        {
+            // No request arguments for this call
+            BITCOIN_ASSERT(request.data.empty());
+            const auto text = stats_text();
+            server_log().debug("stats() -> %u bytes", text.size());
             // Send response
-            respond(count);
+            respond(socket, bcs::data_chunk(text.begin(), text.end()));
             break;
         }
         default:
-            std::cerr << "Error dropping command" << std::endl;
+            server_log().error("Error dropping command %u",
+                static_cast<uint8_t>(request.command));
     }
 }
 
-void blockchain_server::respond(bcs::data_slice data)
+void blockchain_server::journal_commit(
+    const sequenced_batch_list& committed)
+{
+    size_t records = 0;
+    for (const auto& item: committed)
+    {
+        if (item.batch.empty() && !item.kernel)
+            continue;
+        kernel_entry entry;
+        entry.time = commit_time(item);
+        entry.kernel = item.kernel;
+        entry.removed = item.batch.removes();
+        const auto& puts = item.batch.puts();
+        BITCOIN_ASSERT(puts.size() == item.indexes.size());
+        for (size_t i = 0; i < puts.size(); ++i)
+            entry.added.push_back({ item.indexes[i], puts[i] });
+        kernels_.append(entry);
+        records += entry.removed.size() + entry.added.size();
+    }
+    if (!kernels_due(records))
+        return;
+    kernels_.flush();
+    unflushed_kernels_ = 0;
+    kernels_flushed_ = std::chrono::steady_clock::now();
+}
+
+bool blockchain_server::kernels_due(size_t records)
+{
+    unflushed_kernels_ += records;
+    const auto policy = chain_.durability();
+    switch (policy.mode)
+    {
+        case durability_mode::none:
+        {
+            // Only alongside the chain's checkpoints
+            const auto checkpoints = chain_.checkpoints();
+            if (checkpoints == kernels_checkpoints_)
+                return false;
+            kernels_checkpoints_ = checkpoints;
+            return true;
+        }
+        case durability_mode::group:
+        {
+            // The group flusher's limits, checked as commits arrive
+            const auto elapsed = std::chrono::steady_clock::now() -
+                kernels_flushed_;
+            return unflushed_kernels_ >= policy.records ||
+                elapsed >= std::chrono::milliseconds(policy.interval_ms);
+        }
+        case durability_mode::commit:
+            // Before any submitter or subscriber learns of the commit
+            return true;
+    }
+    return true;
+}
+
+uint32_t blockchain_server::commit_time(
+    const sequenced_batch& committed) const
+{
+    // Outputs of one commit share its time
+    if (committed.indexes.empty())
+        return std::time(nullptr);
+    return chain_.get(committed.indexes.front()).time;
+}
+
+std::string blockchain_server::stats_text()
+{
+    auto& metrics = server_metrics();
+    metrics.gauge_for("chain_sequencer_pending").store(sequencer_.pending());
+    metrics.gauge_for("blockchain_live_outputs").store(chain_.live_count());
+    metrics.gauge_for("blockchain_records_remaps").store(
+        chain_.records_remaps());
+    const auto flushes = chain_.journal_flush_stats();
+    metrics.gauge_for("blockchain_journal_flushes").store(flushes.flushes);
+    metrics.gauge_for("blockchain_journal_flush_max_microseconds").store(
+        flushes.max_microseconds);
+    metrics.gauge_for("logger_dropped_lines").store(server_log().dropped());
+    return metrics.text();
+}
+
+void blockchain_server::respond(zsock_t* socket, bcs::data_slice data)
 {
     zmsg_t* message = zmsg_new();
     assert(message);
@@ -139,16 +551,34 @@ void blockchain_server::respond(bcs::data_slice data)
     assert(frame);
     zmsg_append(message, &frame);
     assert(zmsg_size(message) == 1);
-    int rc = zmsg_send(&message, socket_);
+    int rc = zmsg_send(&message, socket);
     assert(message == NULL);
     assert(rc == 0);
 }
-void blockchain_server::respond(uint32_t value)
+void blockchain_server::respond(zsock_t* socket, const output_record& record)
+{
+    bcs::data_chunk data(blockchain_record_size);
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_bytes(record.point);
+    serial.write_4_bytes_little_endian(record.time);
+    respond(socket, data);
+}
+void blockchain_server::respond(zsock_t* socket, uint32_t value)
 {
     bcs::data_chunk data(4);
     auto serial = bcs::make_unsafe_serializer(data.begin());
     serial.write_4_bytes_little_endian(value);
-    respond(data);
+    respond(socket, data);
+}
+
+void blockchain_server::respond(zsock_t* socket,
+    const output_index_list& indexes)
+{
+    bcs::data_chunk data(4 * indexes.size());
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    for (const auto index: indexes)
+        serial.write_4_bytes_little_endian(index);
+    respond(socket, data);
 }
 
 } // namespace dark
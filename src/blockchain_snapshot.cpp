@@ -0,0 +1,346 @@
+#include <dark/blockchain_snapshot.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+#include <boost/filesystem.hpp>
+
+namespace dark {
+
+constexpr generation_type never_removed =
+    std::numeric_limits<generation_type>::max();
+// Enough chunks to cover every 32 bit output index
+constexpr size_t max_chunks =
+    (size_t(std::numeric_limits<output_index_type>::max()) + 1) >> 16;
+
+record_versions::record_versions()
+  : chunks_(new std::atomic<chunk*>[max_chunks])
+{
+    for (size_t i = 0; i < max_chunks; ++i)
+        chunks_[i] = nullptr;
+}
+record_versions::~record_versions()
+{
+    for (size_t i = 0; i < chunks_count_; ++i)
+        delete chunks_[i].load();
+}
+
+void record_versions::reserve(output_index_type count)
+{
+    const auto needed = (size_t(count) + chunk_size - 1) >> chunk_bits;
+    std::lock_guard<std::mutex> lock(reserve_mutex_);
+    for (; chunks_count_ < needed; ++chunks_count_)
+    {
+        auto* block = new chunk;
+        for (auto& value: *block)
+        {
+            // Removed at generation 0 hides the slot from every snapshot
+            value.created = 0;
+            value.removed = 0;
+            value.prefix = 0;
+        }
+        chunks_[chunks_count_].store(block, std::memory_order_release);
+    }
+}
+
+const record_versions::entry& record_versions::at(
+    const output_index_type index) const
+{
+    const auto* block = chunks_[index >> chunk_bits].load(
+        std::memory_order_acquire);
+    BITCOIN_ASSERT(block != nullptr);
+    return (*block)[index & (chunk_size - 1)];
+}
+record_versions::entry& record_versions::at(const output_index_type index)
+{
+    auto* block = chunks_[index >> chunk_bits].load(
+        std::memory_order_acquire);
+    BITCOIN_ASSERT(block != nullptr);
+    return (*block)[index & (chunk_size - 1)];
+}
+
+void record_versions::created(
+    const output_index_type index, generation_type generation)
+{
+    auto& value = at(index);
+    value.created.store(generation, std::memory_order_relaxed);
+    // Publishing removed last makes the new created value visible
+    value.removed.store(never_removed, std::memory_order_release);
+}
+
+void record_versions::removed(const output_index_type index,
+    generation_type generation, uint8_t prefix)
+{
+    auto& value = at(index);
+    value.prefix.store(prefix, std::memory_order_relaxed);
+    value.removed.store(generation, std::memory_order_release);
+}
+
+bool record_versions::visible(const output_index_type index,
+    generation_type generation) const
+{
+    if (chunks_[index >> chunk_bits].load(std::memory_order_acquire) ==
+        nullptr)
+        return false;
+    const auto& value = at(index);
+    const auto removed = value.removed.load(std::memory_order_acquire);
+    const auto created = value.created.load(std::memory_order_relaxed);
+    return created <= generation && removed > generation;
+}
+
+uint8_t record_versions::removed_prefix(const output_index_type index) const
+{
+    return at(index).prefix.load(std::memory_order_acquire);
+}
+
+blockchain_snapshot::blockchain_snapshot(const blockchain& chain,
+    generation_type generation, output_index_type count)
+  : chain_(chain), generation_(generation), count_(count)
+{
+}
+
+blockchain_snapshot::~blockchain_snapshot()
+{
+    chain_.release_snapshot(generation_);
+}
+
+generation_type blockchain_snapshot::generation() const
+{
+    return generation_;
+}
+
+output_index_type blockchain_snapshot::count() const
+{
+    return count_;
+}
+
+bool blockchain_snapshot::exists(const output_index_type index) const
+{
+    return index < count_ && chain_.versions_->visible(index, generation_);
+}
+
+// The writer may tombstone a classic record after the snapshot was
+// taken, in which case its prefix byte was saved beforehand.
+output_record restore_prefix(const record_versions& versions,
+    const output_index_type index, output_record record)
+{
+    if (record.point[0] == 0)
+        record.point[0] = versions.removed_prefix(index);
+    return record;
+}
+
+output_record blockchain_snapshot::get(const output_index_type index) const
+{
+    // Spent slots read back as stored, like blockchain::get()
+    if (!exists(index))
+        return chain_.get(index);
+    return restore_prefix(*chain_.versions_, index, chain_.read_record(index));
+}
+
+// Indexes of the live bitmap gathered, then read, per window. No record
+// mapping is held while removed_after() takes the shard locks.
+constexpr output_index_type snapshot_scan_window = 1 << 16;
+
+void blockchain_snapshot::for_each_live(output_index_type first,
+    output_index_type last,
+    std::function<void (output_index_type, const output_record&)>
+        handler) const
+{
+    const auto& versions = *chain_.versions_;
+    last = std::min(last, count_);
+    output_index_list indexes;
+    while (first < last)
+    {
+        const auto end = first +
+            std::min(last - first, snapshot_scan_window);
+        indexes.clear();
+        chain_.for_each_live_index(first, end,
+            [&indexes](output_index_type index)
+        {
+            indexes.push_back(index);
+        });
+
+        // Slots spent since the snapshot are no longer in the bitmap.
+        // Gathered after the walk, a slot spent during it is in one or
+        // the other.
+        const auto middle = indexes.size();
+        const auto removed = chain_.removed_after(generation_, first, end);
+        indexes.insert(indexes.end(), removed.begin(), removed.end());
+        std::sort(indexes.begin() + middle, indexes.end());
+        std::inplace_merge(indexes.begin(), indexes.begin() + middle,
+            indexes.end());
+        indexes.erase(std::unique(indexes.begin(), indexes.end()),
+            indexes.end());
+
+        chain_.read_records(indexes,
+            [&](output_index_type index, const output_record& record)
+        {
+            if (versions.visible(index, generation_))
+                handler(index, restore_prefix(versions, index, record));
+        });
+        first = end;
+    }
+}
+
+output_index_type blockchain_snapshot::scan(output_index_type cursor,
+    uint32_t limit, output_index_list& indexes,
+    std::vector<output_record>& records) const
+{
+    if (limit == 0 || limit > scan_max_records)
+        limit = scan_max_records;
+    indexes.clear();
+    records.clear();
+    // Only the last window can overshoot
+    auto next = cursor;
+    while (next < count_ && records.size() < limit)
+    {
+        const auto last = static_cast<output_index_type>(
+            std::min<uint64_t>(uint64_t(next) + limit, count_));
+        for_each_live(next, last,
+            [&](output_index_type index, const output_record& record)
+        {
+            indexes.push_back(index);
+            records.push_back(record);
+        });
+        next = last;
+    }
+    if (records.size() > limit)
+    {
+        next = indexes[limit];
+        indexes.resize(limit);
+        records.resize(limit);
+        return next;
+    }
+    return next >= count_ ? scan_complete : next;
+}
+
+// A time index entry stands for the output if the slot is visible and
+// still holds a record created at that time. A slot spent and reused
+// within the same second yields two entries, so callers deduplicate.
+bool blockchain_snapshot::created_at(const output_index_type index,
+    const uint32_t time) const
+{
+    return exists(index) && get(index).time == time;
+}
+
+output_index_list blockchain_snapshot::created_between(uint32_t from,
+    uint32_t to) const
+{
+    output_index_list result;
+    std::unordered_set<output_index_type> seen;
+    chain_.for_each_created(from, to,
+        [&](output_index_type index, uint32_t time)
+    {
+        if (created_at(index, time) && seen.insert(index).second)
+            result.push_back(index);
+        return true;
+    });
+    return result;
+}
+
+output_index_list blockchain_snapshot::newest(size_t count) const
+{
+    output_index_list result;
+    std::unordered_set<output_index_type> seen;
+    if (count == 0)
+        return result;
+    chain_.for_each_newest(
+        [&](output_index_type index, uint32_t time)
+    {
+        if (created_at(index, time) && seen.insert(index).second)
+            result.push_back(index);
+        return result.size() < count;
+    });
+    return result;
+}
+
+uint64_t snapshot_file_checksum(uint64_t checksum, const uint8_t* data,
+    size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        checksum ^= data[i];
+        checksum *= 0x100000001b3;
+    }
+    return checksum;
+}
+
+// Records are buffered and written in blocks of this many.
+constexpr size_t snapshot_file_block_records = 4096;
+
+snapshot_file_writer::snapshot_file_writer(const std::string& path)
+  : path_(path), staged_path_(path + ".new"),
+    file_(staged_path_, std::ios::binary | std::ios::trunc)
+{
+    // The header is filled in by commit()
+    const bcs::data_chunk header(snapshot_file_header_size, 0);
+    file_.write(reinterpret_cast<const char*>(header.data()), header.size());
+    block_.reserve(snapshot_file_block_records * snapshot_file_record_size);
+}
+
+void snapshot_file_writer::add(output_index_type index,
+    const output_record& record)
+{
+    const auto offset = block_.size();
+    block_.resize(offset + snapshot_file_record_size);
+    auto serial = bcs::make_unsafe_serializer(block_.begin() + offset);
+    serial.write_4_bytes_little_endian(index);
+    serial.write_bytes(record.point);
+    serial.write_4_bytes_little_endian(record.time);
+    ++live_;
+    if (block_.size() == block_.capacity())
+        write_block();
+}
+
+bool snapshot_file_writer::commit(size_t shards, record_layout layout,
+    output_index_type count, generation_type generation)
+{
+    write_block();
+
+    bcs::data_chunk header(snapshot_file_header_size);
+    auto serial = bcs::make_unsafe_serializer(header.begin());
+    serial.write_4_bytes_little_endian(snapshot_file_magic);
+    serial.write_4_bytes_little_endian(snapshot_file_version);
+    serial.write_4_bytes_little_endian(shards);
+    serial.write_4_bytes_little_endian(static_cast<uint32_t>(layout));
+    serial.write_4_bytes_little_endian(count);
+    serial.write_4_bytes_little_endian(live_);
+    serial.write_8_bytes_little_endian(generation);
+    serial.write_8_bytes_little_endian(checksum_);
+    file_.seekp(0);
+    file_.write(reinterpret_cast<const char*>(header.data()), header.size());
+    file_.close();
+    if (!file_)
+    {
+        std::cerr << "blockchain: failed writing " << staged_path_
+            << std::endl;
+        boost::filesystem::remove(staged_path_);
+        return false;
+    }
+
+    // Only a complete file is ever renamed into place
+    boost::filesystem::rename(staged_path_, path_);
+    return true;
+}
+
+void snapshot_file_writer::write_block()
+{
+    checksum_ = snapshot_file_checksum(checksum_, block_.data(),
+        block_.size());
+    file_.write(reinterpret_cast<const char*>(block_.data()), block_.size());
+    block_.clear();
+}
+
+bool blockchain_snapshot::write_file(const std::string& path) const
+{
+    snapshot_file_writer writer(path);
+    for_each_live(0, count_,
+        [&writer](output_index_type index, const output_record& record)
+    {
+        writer.add(index, record);
+    });
+    return writer.commit(chain_.shards_count(), chain_.layout(), count_,
+        generation_);
+}
+
+} // namespace dark
@@ -0,0 +1,135 @@
+#include <dark/chain_feed.hpp>
+
+namespace dark {
+
+constexpr size_t chain_delta_header_size = 8 + 4 + 4 + 4;
+constexpr size_t chain_delta_output_size = 4 + bcs::ec_compressed_size;
+
+bcs::data_chunk chain_delta::to_data() const
+{
+    bcs::data_chunk data(chain_delta_header_size + 4 * removed.size() +
+        chain_delta_output_size * added.size());
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_8_bytes_little_endian(sequence);
+    serial.write_4_bytes_little_endian(time);
+    serial.write_4_bytes_little_endian(removed.size());
+    serial.write_4_bytes_little_endian(added.size());
+    for (const auto index: removed)
+        serial.write_4_bytes_little_endian(index);
+    for (const auto& output: added)
+    {
+        serial.write_4_bytes_little_endian(output.index);
+        serial.write_bytes(output.point);
+    }
+    return data;
+}
+
+bool chain_delta::from_data(bcs::data_slice data)
+{
+    if (data.size() < chain_delta_header_size)
+        return false;
+    auto deserial = bcs::make_unsafe_deserializer(data.begin());
+    sequence = deserial.read_8_bytes_little_endian();
+    time = deserial.read_4_bytes_little_endian();
+    const size_t removed_count = deserial.read_4_bytes_little_endian();
+    const size_t added_count = deserial.read_4_bytes_little_endian();
+    if (data.size() != chain_delta_header_size + 4 * removed_count +
+        chain_delta_output_size * added_count)
+        return false;
+
+    removed.resize(removed_count);
+    for (auto& index: removed)
+        index = deserial.read_4_bytes_little_endian();
+    added.resize(added_count);
+    for (auto& output: added)
+    {
+        output.index = deserial.read_4_bytes_little_endian();
+        output.point = deserial.read_forward<bcs::ec_compressed_size>();
+    }
+    return true;
+}
+
+chain_feed::chain_feed(const std::string& bind)
+{
+    socket_ = zsock_new(ZMQ_PUB);
+    bind_endpoints(socket_, bind);
+}
+chain_feed::~chain_feed()
+{
+    zsock_destroy(&socket_);
+}
+
+void chain_feed::publish(chain_delta& delta)
+{
+    delta.sequence = ++sequence_;
+    const auto data = delta.to_data();
+    zmsg_t* message = zmsg_new();
+    assert(message);
+    zframe_t* frame = zframe_new(data.data(), data.size());
+    assert(frame);
+    zmsg_append(message, &frame);
+    // Slow subscribers lose deltas at their high water mark rather than
+    // holding up commits, and see the gap in the sequence.
+    int rc = zmsg_send(&message, socket_);
+    assert(!message);
+    assert(rc == 0);
+}
+
+void chain_feed::publish(const sequenced_batch& committed, uint32_t time)
+{
+    if (committed.batch.empty())
+        return;
+    chain_delta delta;
+    delta.time = time;
+    delta.removed = committed.batch.removes();
+    const auto& puts = committed.batch.puts();
+    BITCOIN_ASSERT(puts.size() == committed.indexes.size());
+    for (size_t i = 0; i < puts.size(); ++i)
+        delta.added.push_back({ committed.indexes[i], puts[i] });
+    publish(delta);
+}
+
+chain_feed_subscriber::chain_feed_subscriber(const std::string& endpoint)
+{
+    socket_ = zsock_new(ZMQ_SUB);
+    zsock_connect(socket_, "%s", endpoint.c_str());
+    zsock_set_subscribe(socket_, "");
+}
+chain_feed_subscriber::~chain_feed_subscriber()
+{
+    zsock_destroy(&socket_);
+}
+
+bool chain_feed_subscriber::receive(chain_delta& delta)
+{
+    while (true)
+    {
+        zmsg_t* message = zmsg_recv(socket_);
+        // Interrupted or shutting down
+        if (!message)
+            return false;
+        zframe_t* frame = zmsg_pop(message);
+        const bool valid = frame && delta.from_data(
+            bcs::data_slice(zframe_data(frame),
+                zframe_data(frame) + zframe_size(frame)));
+        zframe_destroy(&frame);
+        zmsg_destroy(&message);
+        if (!valid)
+            continue;
+
+        // The first delta after subscribing is never a gap
+        if (last_sequence_ != 0 && delta.sequence != last_sequence_ + 1)
+            missed_ += delta.sequence > last_sequence_ ?
+                delta.sequence - last_sequence_ - 1 : 1;
+        last_sequence_ = delta.sequence;
+        return true;
+    }
+}
+
+uint64_t chain_feed_subscriber::missed() const
+{
+    return missed_;
+}
+
+} // namespace dark
+
@@ -0,0 +1,181 @@
+#include <dark/chain_sequencer.hpp>
+
+#include <iterator>
+
+namespace dark {
+
+chain_sequencer::chain_sequencer(dark::blockchain& chain)
+  : chain_(chain)
+{
+    writer_ = std::thread([this] { run_writer(); });
+}
+chain_sequencer::~chain_sequencer()
+{
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_condition_.notify_one();
+    writer_.join();
+}
+
+std::future<boost::optional<output_index_list>> chain_sequencer::submit(
+    const blockchain_batch& batch,
+    const boost::optional<transaction_kernel>& kernel)
+{
+    auto* item = new submission;
+    item->batch = batch;
+    item->kernel = kernel;
+    auto result = item->done.get_future();
+    pending_.fetch_add(1, std::memory_order_relaxed);
+
+    auto* head = head_.load(std::memory_order_relaxed);
+    do
+        item->next = head;
+    while (!head_.compare_exchange_weak(head, item,
+        std::memory_order_release, std::memory_order_relaxed));
+
+    // The writer only sleeps once it finds the queue empty
+    if (!head)
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_condition_.notify_one();
+    }
+    return result;
+}
+
+boost::optional<output_index_list> chain_sequencer::commit(
+    const blockchain_batch& batch)
+{
+    return submit(batch).get();
+}
+output_index_type chain_sequencer::put(const bcs::ec_compressed& point)
+{
+    blockchain_batch batch;
+    batch.put(point);
+    // Batches of puts alone are never rejected
+    return commit(batch)->front();
+}
+bool chain_sequencer::remove(const output_index_type index)
+{
+    blockchain_batch batch;
+    batch.remove(index);
+    return static_cast<bool>(commit(batch));
+}
+
+void chain_sequencer::set_commit_handler(commit_handler handler)
+{
+    on_commit_ = handler;
+}
+
+const dark::blockchain& chain_sequencer::chain() const
+{
+    return chain_;
+}
+
+size_t chain_sequencer::pending() const
+{
+    return pending_.load(std::memory_order_relaxed);
+}
+
+void chain_sequencer::run_writer()
+{
+    while (true)
+    {
+        auto* taken = head_.exchange(nullptr, std::memory_order_acquire);
+        if (!taken)
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            if (stopping_ && !head_.load(std::memory_order_acquire))
+                return;
+            wake_condition_.wait(lock, [this]
+            {
+                return stopping_ ||
+                    head_.load(std::memory_order_acquire) != nullptr;
+            });
+            continue;
+        }
+
+        // Taken newest first, so reverse into submission order
+        submission* oldest = nullptr;
+        while (taken)
+        {
+            auto* next = taken->next;
+            taken->next = oldest;
+            oldest = taken;
+            taken = next;
+        }
+
+        while (oldest)
+        {
+            // Spending one output twice must stay two commits, so the
+            // second is rejected on its own.
+            auto* end = oldest->next;
+            blockchain_batch merged = oldest->batch;
+            for (size_t size = 1; end && size < max_group_size &&
+                !merged.overlaps(end->batch); ++size, end = end->next)
+                merged.append(end->batch);
+
+            // The chain checks every remove is still unspent as it
+            // commits. A merged commit is rejected whole, so retry its
+            // batches one by one to reject only those at fault.
+            const auto indexes = chain_.commit(merged);
+            if (indexes)
+                complete(oldest, end, *indexes);
+            else
+                for (auto* item = oldest; item != end;)
+                {
+                    auto* next = item->next;
+                    commit_alone(item);
+                    item = next;
+                }
+            oldest = end;
+        }
+    }
+}
+
+void chain_sequencer::commit_alone(submission* item)
+{
+    const auto indexes = chain_.commit(item->batch);
+    if (indexes)
+    {
+        complete(item, item->next, *indexes);
+        return;
+    }
+    item->done.set_value(boost::none);
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+    delete item;
+}
+
+void chain_sequencer::complete(submission* first, submission* end,
+    const output_index_list& indexes)
+{
+    // Puts come back in staging order, so slice them per submission
+    sequenced_batch_list committed;
+    auto index = indexes.begin();
+    for (auto* item = first; item != end; item = item->next)
+    {
+        const auto puts = item->batch.puts_count();
+        BITCOIN_ASSERT(static_cast<size_t>(
+            std::distance(index, indexes.end())) >= puts);
+        committed.push_back({ std::move(item->batch), std::move(item->kernel),
+            output_index_list(index, index + puts) });
+        index += puts;
+    }
+    if (on_commit_)
+        on_commit_(committed);
+
+    auto result = committed.begin();
+    while (first != end)
+    {
+        auto* next = first->next;
+        first->done.set_value(std::move(result->indexes));
+        ++result;
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        delete first;
+        first = next;
+    }
+}
+
+} // namespace dark
+
@@ -0,0 +1,191 @@
+#include <dark/commitment_index.hpp>
+
+#include <random>
+
+namespace dark {
+
+// Layout: [seed:8][capacity:4][size:4] followed by capacity slots of
+// [hash:4][index + 1:4]. An index field of zero marks an empty slot.
+constexpr size_t index_header_size = 8 + 4 + 4;
+constexpr size_t index_slot_size = 4 + 4;
+constexpr uint32_t index_initial_capacity = 1024;
+
+struct index_slot
+{
+    uint32_t hash;
+    uint32_t value;
+};
+static_assert(sizeof(index_slot) == index_slot_size, "packed slot");
+
+index_slot* slots_of(uint8_t* buffer)
+{
+    return reinterpret_cast<index_slot*>(buffer + index_header_size);
+}
+
+commitment_index::commitment_index(const std::string& filename)
+  : storage_(filename)
+{
+    storage_.open();
+    if (storage_.logical() < index_header_size)
+    {
+        clear();
+        return;
+    }
+
+    auto memory = storage_.access();
+    auto deserial = bcs::make_unsafe_deserializer(memory->buffer());
+    seed_ = deserial.read_8_bytes_little_endian();
+    capacity_ = deserial.read_4_bytes_little_endian();
+    size_ = deserial.read_4_bytes_little_endian();
+}
+
+void commitment_index::clear()
+{
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    std::random_device device;
+    seed_ = (uint64_t(device()) << 32) | device();
+    capacity_ = index_initial_capacity;
+    size_ = 0;
+
+    const auto file_size = index_header_size + capacity_ * index_slot_size;
+    auto memory = storage_.resize(file_size);
+    auto* buffer = memory->buffer();
+    std::fill(buffer + index_header_size, buffer + file_size, 0);
+    auto serial = bcs::make_unsafe_serializer(buffer);
+    serial.write_8_bytes_little_endian(seed_);
+    serial.write_4_bytes_little_endian(capacity_);
+    serial.write_4_bytes_little_endian(size_);
+}
+
+// Points are chosen by users, so the seed keeps them from crafting
+// keys that all land in one probe run.
+uint32_t commitment_index::hash(const bcs::ec_compressed& point) const
+{
+    uint64_t result = seed_;
+    for (size_t i = 0; i < bcs::ec_compressed_size; ++i)
+    {
+        result ^= point[i];
+        result *= 0x100000001b3;
+    }
+    result ^= result >> 33;
+    result *= 0xff51afd7ed558ccd;
+    result ^= result >> 33;
+    return static_cast<uint32_t>(result);
+}
+
+void commitment_index::insert(
+    const bcs::ec_compressed& point, output_index_type index)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    // Keep the load factor under 70%
+    if ((size_ + 1) * 10 > capacity_ * 7)
+        grow();
+
+    const auto key = hash(point);
+    const auto mask = capacity_ - 1;
+    auto memory = storage_.access();
+    auto* slots = slots_of(memory->buffer());
+    auto position = key & mask;
+    while (slots[position].value != 0)
+        position = (position + 1) & mask;
+    slots[position] = { key, index + 1 };
+
+    ++size_;
+    auto serial = bcs::make_unsafe_serializer(memory->buffer() + 8 + 4);
+    serial.write_4_bytes_little_endian(size_);
+}
+
+void commitment_index::erase(
+    const bcs::ec_compressed& point, output_index_type index)
+{
+    std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+    const auto key = hash(point);
+    const auto mask = capacity_ - 1;
+    auto memory = storage_.access();
+    auto* slots = slots_of(memory->buffer());
+    auto position = key & mask;
+    while (slots[position].value != index + 1)
+    {
+        // Not indexed
+        if (slots[position].value == 0)
+            return;
+        position = (position + 1) & mask;
+    }
+
+    // Backward shift deletion keeps probe runs intact without tombstones
+    auto hole = position;
+    auto next = (hole + 1) & mask;
+    while (slots[next].value != 0)
+    {
+        const auto home = slots[next].hash & mask;
+        // Move the entry back if the hole lies between its home and it
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    slots[hole] = { 0, 0 };
+
+    --size_;
+    auto serial = bcs::make_unsafe_serializer(memory->buffer() + 8 + 4);
+    serial.write_4_bytes_little_endian(size_);
+}
+
+output_index_list commitment_index::candidates(
+    const bcs::ec_compressed& point) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+    output_index_list result;
+    const auto key = hash(point);
+    const auto mask = capacity_ - 1;
+    auto memory = storage_.access();
+    const auto* slots = slots_of(memory->buffer());
+    for (auto position = key & mask; slots[position].value != 0;
+        position = (position + 1) & mask)
+    {
+        if (slots[position].hash == key)
+            result.push_back(slots[position].value - 1);
+    }
+    return result;
+}
+
+void commitment_index::grow()
+{
+    std::vector<index_slot> entries;
+    entries.reserve(size_);
+    {
+        auto memory = storage_.access();
+        const auto* slots = slots_of(memory->buffer());
+        for (size_t i = 0; i < capacity_; ++i)
+            if (slots[i].value != 0)
+                entries.push_back(slots[i]);
+    }
+
+    capacity_ *= 2;
+    const auto file_size = index_header_size + capacity_ * index_slot_size;
+    auto memory = storage_.resize(file_size);
+    auto* buffer = memory->buffer();
+    std::fill(buffer + index_header_size, buffer + file_size, 0);
+    auto serial = bcs::make_unsafe_serializer(buffer + 8);
+    serial.write_4_bytes_little_endian(capacity_);
+
+    const auto mask = capacity_ - 1;
+    auto* slots = slots_of(buffer);
+    for (const auto& entry: entries)
+    {
+        auto position = entry.hash & mask;
+        while (slots[position].value != 0)
+            position = (position + 1) & mask;
+        slots[position] = entry;
+    }
+}
+
+void commitment_index::flush()
+{
+    storage_.flush();
+}
+
+} // namespace dark
+
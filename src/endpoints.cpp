@@ -0,0 +1,55 @@
+#include <dark/endpoints.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+namespace dark {
+
+void add_local_endpoint(std::string& bind, const std::string& path)
+{
+    bind += ",ipc://" + path;
+}
+
+endpoint_config local_endpoints()
+{
+    endpoint_config config;
+    const char* runtime = std::getenv("XDG_RUNTIME_DIR");
+    if (!runtime || *runtime != '/')
+        return config;
+    const std::string directory = std::string(runtime) + "/darktech-";
+    // Connects stay on tcp, since a client has no way to tell that no
+    // server is listening on the socket path
+    add_local_endpoint(config.blockchain_bind, directory + "blockchain");
+    add_local_endpoint(config.messages_bind, directory + "messages");
+    add_local_endpoint(config.publish_bind, directory + "publish");
+    add_local_endpoint(config.feed_bind, directory + "feed");
+    return config;
+}
+
+endpoint_config& default_endpoints()
+{
+    static endpoint_config config = local_endpoints();
+    return config;
+}
+
+bool bind_endpoints(zsock_t* socket, const std::string& endpoints)
+{
+    bool result = true;
+    std::istringstream list(endpoints);
+    std::string endpoint;
+    while (std::getline(list, endpoint, ','))
+    {
+        if (endpoint.empty())
+            continue;
+        if (zsock_bind(socket, "%s", endpoint.c_str()) == -1)
+        {
+            std::cerr << "Error binding " << endpoint << std::endl;
+            result = false;
+        }
+    }
+    return result;
+}
+
+} // namespace dark
+
@@ -0,0 +1,533 @@
+#include <dark/kernel_journal.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include <boost/optional.hpp>
+#include <dark/blockchain_snapshot.hpp>
+#include <dark/point_cache.hpp>
+
+namespace dark {
+
+namespace fs = boost::filesystem;
+
+// Segments hold [first sequence:8] followed by frames of
+// [body size:4][body][sha256(body):32], the same framing as the chain
+// journal. A body is
+//   [sequence:8][time:4][fee:8][excess:33][witness:33][response:32]
+//   [removed count:4]([index:4])...
+//   [added count:4]([index:4][point:33])...
+// Entries without a kernel have it all zero, which no valid excess is.
+// The index holds [indexed count:8] then [segment:4][offset:4] for each
+// sequence. Its count only covers entries synced by flush().
+constexpr size_t kernel_segment_header_size = sizeof(uint64_t);
+constexpr size_t kernel_index_header_size = sizeof(uint64_t);
+constexpr size_t kernel_index_entry_size = 4 + 4;
+constexpr size_t kernel_body_minimum_size = 8 + 4 + 8 +
+    2 * bcs::ec_compressed_size + bcs::ec_secret_size + 4 + 4;
+constexpr size_t kernel_added_size = 4 + bcs::ec_compressed_size;
+
+// Kernels verified per thread in one parallel pass of a rebuild.
+constexpr size_t kernel_verify_block = 1024;
+
+void create_file(const std::string& path, uint64_t header)
+{
+    bcs::data_chunk data(sizeof(uint64_t));
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_8_bytes_little_endian(header);
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// Decodes the frame at offset, returning its size. Returns zero if the
+// frame is torn, corrupt or not the expected sequence.
+size_t decode_kernel_frame(const uint8_t* buffer, size_t size,
+    size_t offset, uint64_t sequence, kernel_entry& entry)
+{
+    if (offset + 4 > size)
+        return 0;
+    auto frame = bcs::make_unsafe_deserializer(buffer + offset);
+    const size_t body_size = frame.read_4_bytes_little_endian();
+    const auto frame_size = 4 + body_size + bcs::hash_size;
+    if (body_size < kernel_body_minimum_size || offset + frame_size > size)
+        return 0;
+
+    const auto* body = buffer + offset + 4;
+    const bcs::data_slice body_slice(body, body + body_size);
+    auto check = bcs::make_unsafe_deserializer(body + body_size);
+    if (bcs::sha256_hash(body_slice) != check.read_hash())
+        return 0;
+
+    auto deserial = bcs::make_unsafe_deserializer(body);
+    entry.sequence = deserial.read_8_bytes_little_endian();
+    if (entry.sequence != sequence)
+        return 0;
+    entry.time = deserial.read_4_bytes_little_endian();
+    transaction_kernel kernel;
+    kernel.fee = deserial.read_8_bytes_little_endian();
+    const auto excess = deserial.read_forward<bcs::ec_compressed_size>();
+    const auto witness = deserial.read_forward<bcs::ec_compressed_size>();
+    const auto response = deserial.read_forward<bcs::ec_secret_size>();
+    entry.kernel = boost::none;
+    if (excess[0] != 0)
+    {
+        kernel.excess = excess;
+        kernel.signature.witness = witness;
+        kernel.signature.response = response;
+        entry.kernel = kernel;
+    }
+
+    const size_t removed_count = deserial.read_4_bytes_little_endian();
+    if (kernel_body_minimum_size + removed_count * 4 > body_size)
+        return 0;
+    entry.removed.resize(removed_count);
+    for (auto& index: entry.removed)
+        index = deserial.read_4_bytes_little_endian();
+
+    const size_t added_count = deserial.read_4_bytes_little_endian();
+    if (kernel_body_minimum_size + removed_count * 4 +
+        added_count * kernel_added_size != body_size)
+        return 0;
+    entry.added.resize(added_count);
+    for (auto& output: entry.added)
+    {
+        output.index = deserial.read_4_bytes_little_endian();
+        output.point = deserial.read_forward<bcs::ec_compressed_size>();
+    }
+    return frame_size;
+}
+
+kernel_journal::kernel_journal(const std::string& directory,
+    size_t segment_size)
+  : directory_(directory), segment_size_(segment_size),
+    index_storage_((fs::path(directory) / "index").string())
+{
+    fs::create_directories(directory_);
+    const auto index_path = (fs::path(directory_) / "index").string();
+    if (!fs::exists(index_path))
+        create_file(index_path, 0);
+    index_storage_.open();
+
+    if (!fs::exists(segment_path(0)))
+        create_file(segment_path(0), 0);
+    while (fs::exists(segment_path(segment_ + 1)))
+        ++segment_;
+    segment_storage_ = open_segment(segment_);
+
+    // Find the end of the last segment, dropping a torn entry
+    uint64_t last_first;
+    {
+        const auto size = segment_storage_->logical();
+        auto memory = segment_storage_->access();
+        auto header = bcs::make_unsafe_deserializer(memory->buffer());
+        last_first = header.read_8_bytes_little_endian();
+        count_ = last_first;
+        segment_end_ = kernel_segment_header_size;
+        kernel_entry entry;
+        while (true)
+        {
+            const auto frame_size = decode_kernel_frame(memory->buffer(),
+                size, segment_end_, count_, entry);
+            if (frame_size == 0)
+                break;
+            segment_end_ += frame_size;
+            ++count_;
+        }
+    }
+
+    // Entries past the synced count may be missing from the index
+    uint64_t indexed;
+    {
+        auto memory = index_storage_.access();
+        auto header = bcs::make_unsafe_deserializer(memory->buffer());
+        indexed = header.read_8_bytes_little_endian();
+    }
+    indexed = std::min(indexed, last_first);
+    auto segment = segment_;
+    while (segment > 0)
+    {
+        auto storage = open_segment(segment);
+        auto memory = storage->access();
+        auto header = bcs::make_unsafe_deserializer(memory->buffer());
+        if (header.read_8_bytes_little_endian() <= indexed)
+            break;
+        --segment;
+    }
+    for (; segment <= segment_; ++segment)
+        index_segment(segment, indexed);
+    flush();
+}
+
+kernel_journal::~kernel_journal()
+{
+    flush();
+}
+
+std::string kernel_journal::segment_path(uint32_t segment) const
+{
+    std::ostringstream name;
+    name << "segment." << std::setw(6) << std::setfill('0') << segment;
+    return (fs::path(directory_) / name.str()).string();
+}
+
+kernel_journal::storage_ptr kernel_journal::open_segment(
+    uint32_t segment) const
+{
+    auto storage = std::make_shared<bc::database::file_storage>(
+        segment_path(segment));
+    storage->open();
+    return storage;
+}
+
+kernel_journal::storage_ptr kernel_journal::read_segment(
+    uint32_t segment) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (segment == segment_)
+            return segment_storage_;
+    }
+    return open_segment(segment);
+}
+
+void kernel_journal::index_segment(uint32_t segment, uint64_t sequence)
+{
+    const auto storage = read_segment(segment);
+    const auto size = storage->logical();
+    auto memory = storage->access();
+    auto header = bcs::make_unsafe_deserializer(memory->buffer());
+    auto current = header.read_8_bytes_little_endian();
+    size_t offset = kernel_segment_header_size;
+    kernel_entry entry;
+    while (true)
+    {
+        const auto frame_size = decode_kernel_frame(memory->buffer(), size,
+            offset, current, entry);
+        if (frame_size == 0)
+            break;
+        if (current >= sequence)
+        {
+            auto position = index_storage_.reserve(kernel_index_header_size +
+                (current + 1) * kernel_index_entry_size);
+            auto serial = bcs::make_unsafe_serializer(position->buffer() +
+                kernel_index_header_size + current * kernel_index_entry_size);
+            serial.write_4_bytes_little_endian(segment);
+            serial.write_4_bytes_little_endian(offset);
+        }
+        offset += frame_size;
+        ++current;
+    }
+}
+
+void kernel_journal::roll_segment()
+{
+    segment_storage_->flush();
+    ++segment_;
+    create_file(segment_path(segment_), count_);
+    // Readers still holding the old segment keep it mapped
+    segment_storage_ = open_segment(segment_);
+    segment_end_ = kernel_segment_header_size;
+}
+
+void kernel_journal::append(kernel_entry& entry)
+{
+    const auto body_size = kernel_body_minimum_size +
+        entry.removed.size() * 4 + entry.added.size() * kernel_added_size;
+    bcs::data_chunk body(body_size);
+    auto serial = bcs::make_unsafe_serializer(body.begin());
+    // The sequence is written once the entry's position is known
+    serial.skip(sizeof(uint64_t));
+    serial.write_4_bytes_little_endian(entry.time);
+    if (entry.kernel)
+    {
+        serial.write_8_bytes_little_endian(entry.kernel->fee);
+        serial.write_bytes(entry.kernel->excess.point());
+        serial.write_bytes(entry.kernel->signature.witness.point());
+        serial.write_bytes(entry.kernel->signature.response.secret());
+    }
+    else
+        // The body is zero filled
+        serial.skip(8 + 2 * bcs::ec_compressed_size + bcs::ec_secret_size);
+    serial.write_4_bytes_little_endian(entry.removed.size());
+    for (const auto index: entry.removed)
+        serial.write_4_bytes_little_endian(index);
+    serial.write_4_bytes_little_endian(entry.added.size());
+    for (const auto& output: entry.added)
+    {
+        serial.write_4_bytes_little_endian(output.index);
+        serial.write_bytes(output.point);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry.sequence = count_;
+    auto sequence = bcs::make_unsafe_serializer(body.begin());
+    sequence.write_8_bytes_little_endian(count_);
+    const auto checksum = bcs::sha256_hash(body);
+
+    // Oversized entries get a segment of their own
+    const auto frame_size = 4 + body_size + bcs::hash_size;
+    if (segment_end_ > kernel_segment_header_size &&
+        segment_end_ + frame_size > segment_size_)
+        roll_segment();
+
+    auto memory = segment_storage_->reserve(segment_end_ + frame_size);
+    auto frame = bcs::make_unsafe_serializer(memory->buffer() + segment_end_);
+    frame.write_4_bytes_little_endian(body_size);
+    frame.write_bytes(body);
+    frame.write_hash(checksum);
+    memory.reset();
+
+    memory = index_storage_.reserve(kernel_index_header_size +
+        (count_ + 1) * kernel_index_entry_size);
+    auto position = bcs::make_unsafe_serializer(memory->buffer() +
+        kernel_index_header_size + count_ * kernel_index_entry_size);
+    position.write_4_bytes_little_endian(segment_);
+    position.write_4_bytes_little_endian(segment_end_);
+    memory.reset();
+
+    segment_end_ += frame_size;
+    ++count_;
+}
+
+void kernel_journal::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Entries must be durable before the index counts them
+    segment_storage_->flush();
+    {
+        auto memory = index_storage_.access();
+        auto serial = bcs::make_unsafe_serializer(memory->buffer());
+        serial.write_8_bytes_little_endian(count_);
+    }
+    index_storage_.flush();
+}
+
+uint64_t kernel_journal::count() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+}
+
+bool kernel_journal::read(uint64_t sequence, kernel_entry& entry) const
+{
+    bool found = false;
+    for_each(sequence, [&](const kernel_entry& first)
+    {
+        entry = first;
+        found = true;
+        return false;
+    });
+    return found;
+}
+
+void kernel_journal::for_each(uint64_t first,
+    kernel_entry_handler handler) const
+{
+    const auto end = count();
+    if (first >= end)
+        return;
+
+    uint32_t segment;
+    size_t offset;
+    {
+        auto memory = index_storage_.access();
+        auto deserial = bcs::make_unsafe_deserializer(memory->buffer() +
+            kernel_index_header_size + first * kernel_index_entry_size);
+        segment = deserial.read_4_bytes_little_endian();
+        offset = deserial.read_4_bytes_little_endian();
+    }
+
+    kernel_entry entry;
+    for (auto sequence = first; sequence < end; ++segment)
+    {
+        if (!fs::exists(segment_path(segment)))
+        {
+            std::cerr << "kernel_journal: entry " << sequence
+                << " is missing" << std::endl;
+            return;
+        }
+        const auto storage = read_segment(segment);
+        const auto size = storage->logical();
+        auto memory = storage->access();
+        for (; sequence < end; ++sequence)
+        {
+            const auto frame_size = decode_kernel_frame(memory->buffer(),
+                size, offset, sequence, entry);
+            if (frame_size == 0)
+                break;
+            offset += frame_size;
+            if (!handler(entry))
+                return;
+        }
+        offset = kernel_segment_header_size;
+    }
+}
+
+// A kernel with the points its transaction spent and created.
+struct kernel_check
+{
+    uint64_t sequence;
+    transaction_kernel kernel;
+    bcs::point_list inputs;
+    bcs::point_list outputs;
+};
+
+typedef std::vector<kernel_check> kernel_check_list;
+
+// Same checks as message_server::accept_if_valid() bar the rangeproofs,
+// which are not journaled.
+bool verify_kernel(const kernel_check& check)
+{
+    pubkey_list output_keys, input_keys;
+    for (const auto& point: check.outputs)
+    {
+        secp256k1_pubkey key;
+        if (!parse_point(key, point))
+            return false;
+        output_keys.push_back(key);
+    }
+    for (const auto& point: check.inputs)
+    {
+        secp256k1_pubkey key;
+        if (!parse_point(key, point))
+            return false;
+        input_keys.push_back(key);
+    }
+    bcs::ec_compressed excess;
+    return sum_points(excess, output_keys, input_keys) &&
+        check.kernel.excess.point() == excess &&
+        verify(check.kernel.signature, check.kernel.excess);
+}
+
+// Returns the lowest sequence which fails, if any.
+boost::optional<uint64_t> verify_kernels(const kernel_check_list& checks,
+    size_t threads)
+{
+    threads = std::max<size_t>(std::min(threads, checks.size()), 1);
+    std::vector<boost::optional<uint64_t>> failures(threads);
+    std::vector<std::thread> workers;
+    const auto span = (checks.size() + threads - 1) / threads;
+    for (size_t i = 0; i < threads; ++i)
+    {
+        const auto first = std::min(i * span, checks.size());
+        const auto last = std::min(first + span, checks.size());
+        auto& failure = failures[i];
+        workers.emplace_back([&checks, &failure, first, last]
+        {
+            for (auto j = first; j < last && !failure; ++j)
+                if (!verify_kernel(checks[j]))
+                    failure = checks[j].sequence;
+        });
+    }
+    for (auto& worker: workers)
+        worker.join();
+
+    for (const auto& failure: failures)
+        if (failure)
+            return failure;
+    return boost::none;
+}
+
+bool kernel_journal::rebuild(const std::string& directory,
+    const char* prefix, size_t shards, record_layout layout, size_t threads)
+{
+    if (fs::exists(prefix))
+    {
+        std::cerr << "kernel_journal: " << prefix << " already exists"
+            << std::endl;
+        return false;
+    }
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    const kernel_journal journal(directory);
+
+    // Applying entries is sequential while verifying them is not, so
+    // kernels are checked a block at a time behind the replay.
+    std::vector<output_record> records;
+    kernel_check_list checks;
+    boost::optional<uint64_t> invalid, failed, misplaced;
+    journal.for_each(0, [&](const kernel_entry& entry)
+    {
+        kernel_check check{ entry.sequence, {}, {}, {} };
+        for (const auto index: entry.removed)
+        {
+            if (index >= records.size() || records[index].point[0] == 0)
+            {
+                invalid = entry.sequence;
+                return false;
+            }
+            check.inputs.push_back(records[index].point);
+            records[index].point[0] = 0;
+        }
+        for (const auto& output: entry.added)
+        {
+            // find() would look for the output in another shard
+            if (output.index % shards !=
+                blockchain::shard_for(output.point, shards))
+            {
+                misplaced = entry.sequence;
+                return false;
+            }
+            if (output.index >= records.size())
+                records.resize(output.index + 1);
+            else if (records[output.index].point[0] != 0)
+            {
+                invalid = entry.sequence;
+                return false;
+            }
+            records[output.index] = { output.point, entry.time };
+            check.outputs.push_back(output.point);
+        }
+        // Plain puts and removes have nothing to verify
+        if (!entry.kernel)
+            return true;
+        check.kernel = *entry.kernel;
+        checks.push_back(std::move(check));
+
+        if (checks.size() < threads * kernel_verify_block)
+            return true;
+        failed = verify_kernels(checks, threads);
+        checks.clear();
+        return !failed;
+    });
+    if (misplaced)
+    {
+        std::cerr << "kernel_journal: entry " << *misplaced
+            << " was not journaled by a chain of " << shards << " shards"
+            << std::endl;
+        return false;
+    }
+    if (!failed && !checks.empty())
+        failed = verify_kernels(checks, threads);
+    if (failed || invalid)
+    {
+        const auto sequence = failed ? *failed : *invalid;
+        std::cerr << "kernel_journal: entry " << sequence
+            << " does not verify" << std::endl;
+        return false;
+    }
+
+    // The snapshot import builds the chain in one sequential pass
+    const auto path = (fs::path(directory) / "rebuild.snapshot").string();
+    {
+        snapshot_file_writer writer(path);
+        for (size_t index = 0; index < records.size(); ++index)
+            if (records[index].point[0] != 0)
+                writer.add(index, records[index]);
+        if (!writer.commit(shards, layout, records.size(), journal.count()))
+            return false;
+    }
+    const auto rebuilt = blockchain::import_file(path.c_str(), prefix);
+    fs::remove(path);
+    if (rebuilt)
+        std::cout << "kernel_journal: replayed " << journal.count()
+            << " transactions" << std::endl;
+    return rebuilt;
+}
+
+} // namespace dark
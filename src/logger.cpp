@@ -0,0 +1,172 @@
+#include <dark/logger.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace dark {
+
+constexpr size_t logger::max_numbers;
+constexpr size_t logger::max_bytes;
+
+// How long queued lines may wait for the writer
+constexpr auto logger_poll_interval = std::chrono::milliseconds(5);
+
+size_t ring_capacity(size_t capacity)
+{
+    size_t result = 1;
+    while (result < capacity)
+        result <<= 1;
+    return result;
+}
+
+logger::logger(size_t capacity)
+  : mask_(ring_capacity(capacity) - 1),
+    slots_(new slot[mask_ + 1])
+{
+    for (size_t i = 0; i <= mask_; ++i)
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    writer_ = std::thread([this] { run_writer(); });
+}
+logger::~logger()
+{
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex_);
+        stopping_ = true;
+    }
+    stop_condition_.notify_one();
+    writer_.join();
+}
+
+void logger::set_level(log_level level)
+{
+    level_.store(level, std::memory_order_relaxed);
+}
+void logger::set_sample_rate(uint32_t every)
+{
+    sample_rate_.store(std::max(every, 1u), std::memory_order_relaxed);
+}
+
+bool logger::enabled(log_level level) const
+{
+    return level >= level_.load(std::memory_order_relaxed);
+}
+
+uint64_t logger::dropped() const
+{
+    return dropped_.load(std::memory_order_relaxed);
+}
+
+void logger::capture_bytes(entry& line, const uint8_t* data, size_t size)
+{
+    line.bytes_size = static_cast<uint8_t>(std::min(size, max_bytes));
+    std::copy(data, data + line.bytes_size, line.bytes);
+}
+
+void logger::push(const entry& line)
+{
+    auto position = tail_.load(std::memory_order_relaxed);
+    slot* target;
+    while (true)
+    {
+        target = &slots_[position & mask_];
+        const auto sequence = target->sequence.load(std::memory_order_acquire);
+        if (sequence == position)
+        {
+            if (tail_.compare_exchange_weak(position, position + 1,
+                std::memory_order_relaxed))
+                break;
+        }
+        // The writer has not freed this slot since the last lap
+        else if (sequence < position)
+        {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+            position = tail_.load(std::memory_order_relaxed);
+    }
+    target->value = line;
+    target->sequence.store(position + 1, std::memory_order_release);
+}
+
+size_t logger::drain()
+{
+    size_t written = 0;
+    bool errors = false;
+    while (true)
+    {
+        auto& target = slots_[head_ & mask_];
+        if (target.sequence.load(std::memory_order_acquire) != head_ + 1)
+            break;
+        const auto line = format(target.value);
+        const bool error = target.value.level >= log_level::warning;
+        target.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+        ++head_;
+
+        (error ? std::cerr : std::cout) << line << '\n';
+        errors = errors || error;
+        ++written;
+    }
+    // One flush per batch of lines rather than per line
+    if (written > 0)
+        std::cout.flush();
+    if (errors)
+        std::cerr.flush();
+    return written;
+}
+
+void logger::run_writer()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    while (!stopping_)
+    {
+        lock.unlock();
+        drain();
+        lock.lock();
+        stop_condition_.wait_for(lock, logger_poll_interval);
+    }
+    lock.unlock();
+    drain();
+}
+
+std::string logger::format(const entry& line)
+{
+    std::string result;
+    size_t number = 0;
+    for (auto* text = line.format; *text; ++text)
+    {
+        if (*text != '%' || !text[1])
+        {
+            result += *text;
+            continue;
+        }
+        switch (*++text)
+        {
+            case 'u':
+                if (number < line.numbers_count)
+                    result += std::to_string(line.numbers[number++]);
+                break;
+            case 'x':
+                result += bcs::encode_base16(
+                    bcs::data_slice(line.bytes, line.bytes + line.bytes_size));
+                break;
+            case 's':
+                result.append(reinterpret_cast<const char*>(line.bytes),
+                    line.bytes_size);
+                break;
+            default:
+                result += *text;
+        }
+    }
+    return result;
+}
+
+logger& server_log()
+{
+    static logger log;
+    return log;
+}
+
+} // namespace dark
+
@@ -0,0 +1,200 @@
+#include <dark/merkle_tree.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <boost/filesystem.hpp>
+
+namespace dark {
+
+constexpr uint8_t merkle_leaf_tag = 0x00;
+constexpr uint8_t merkle_node_tag = 0x01;
+// [magic:4][sequence:8][size:4] then the nodes of each level
+constexpr uint32_t merkle_file_magic = 0x6b72656d;
+constexpr size_t merkle_file_header_size = 4 + 8 + 4;
+
+// Nodes kept at level for the slots [0, size)
+size_t level_size(output_index_type size, size_t level)
+{
+    return (uint64_t(size) + (uint64_t(1) << level) - 1) >> level;
+}
+
+bcs::hash_digest node_hash(const bcs::hash_digest& left,
+    const bcs::hash_digest& right)
+{
+    bcs::data_chunk data(1 + 2 * bcs::hash_size);
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_byte(merkle_node_tag);
+    serial.write_hash(left);
+    serial.write_hash(right);
+    return bcs::sha256_hash(data);
+}
+
+bcs::hash_digest merkle_tree::leaf_hash(const output_index_type index,
+    const output_record& record)
+{
+    bcs::data_chunk data(1 + 4 + blockchain_record_size);
+    auto serial = bcs::make_unsafe_serializer(data.begin());
+    serial.write_byte(merkle_leaf_tag);
+    serial.write_4_bytes_little_endian(index);
+    serial.write_bytes(record.point);
+    serial.write_4_bytes_little_endian(record.time);
+    return bcs::sha256_hash(data);
+}
+
+bool merkle_tree::verify(const merkle_proof& proof,
+    const bcs::hash_digest& leaf)
+{
+    if (proof.siblings.size() != depth)
+        return false;
+    auto hash = leaf;
+    for (size_t level = 0; level < depth; ++level)
+    {
+        const auto& sibling = proof.siblings[level];
+        if ((proof.index >> level) & 1)
+            hash = node_hash(sibling, hash);
+        else
+            hash = node_hash(hash, sibling);
+    }
+    return hash == proof.root;
+}
+
+const bcs::hash_digest& merkle_tree::empty_hash(size_t level)
+{
+    static const auto hashes = []
+    {
+        bcs::hash_list result(depth + 1, bcs::null_hash);
+        for (size_t i = 1; i <= depth; ++i)
+            result[i] = node_hash(result[i - 1], result[i - 1]);
+        return result;
+    }();
+    return hashes[level];
+}
+
+const bcs::hash_digest& merkle_tree::node(size_t level,
+    uint64_t position) const
+{
+    const auto& nodes = levels_[level];
+    return position < nodes.size() ? nodes[position] : empty_hash(level);
+}
+
+void merkle_tree::resize(output_index_type size)
+{
+    if (size <= size_)
+        return;
+    size_ = size;
+
+    // New slots are empty, so the nodes already kept stay valid
+    for (size_t level = 0; level <= depth; ++level)
+        levels_[level].resize(level_size(size_, level), empty_hash(level));
+}
+
+void merkle_tree::update(const merkle_leaf_list& leaves)
+{
+    if (leaves.empty())
+        return;
+
+    output_index_type highest = 0;
+    for (const auto& entry: leaves)
+        highest = std::max(highest, entry.first);
+    resize(highest + 1);
+
+    std::vector<uint64_t> dirty;
+    dirty.reserve(leaves.size());
+    for (const auto& entry: leaves)
+    {
+        levels_[0][entry.first] = entry.second;
+        dirty.push_back(entry.first / 2);
+    }
+
+    // Siblings share a parent, so each level is deduplicated first
+    for (size_t level = 1; level <= depth; ++level)
+    {
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        auto& parents = levels_[level];
+        for (auto& position: dirty)
+        {
+            parents[position] = node_hash(node(level - 1, 2 * position),
+                node(level - 1, 2 * position + 1));
+            position /= 2;
+        }
+    }
+}
+
+bcs::hash_digest merkle_tree::root() const
+{
+    return node(depth, 0);
+}
+
+output_index_type merkle_tree::size() const
+{
+    return size_;
+}
+
+merkle_proof merkle_tree::prove(const output_index_type index) const
+{
+    BITCOIN_ASSERT(index < size_);
+    merkle_proof proof;
+    proof.index = index;
+    proof.root = root();
+    for (size_t level = 0; level < depth; ++level)
+        proof.siblings.push_back(node(level, (uint64_t(index) >> level) ^ 1));
+    return proof;
+}
+
+bool merkle_tree::save(const std::string& path, uint64_t sequence) const
+{
+    const auto staged_path = path + ".new";
+    std::ofstream file(staged_path, std::ios::binary | std::ios::trunc);
+    bcs::data_chunk header(merkle_file_header_size);
+    auto serial = bcs::make_unsafe_serializer(header.begin());
+    serial.write_4_bytes_little_endian(merkle_file_magic);
+    serial.write_8_bytes_little_endian(sequence);
+    serial.write_4_bytes_little_endian(size_);
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    for (const auto& nodes: levels_)
+        file.write(reinterpret_cast<const char*>(nodes.data()),
+            nodes.size() * bcs::hash_size);
+    file.close();
+    if (!file)
+    {
+        boost::filesystem::remove(staged_path);
+        return false;
+    }
+
+    // Only a complete file is ever renamed into place
+    boost::filesystem::rename(staged_path, path);
+    return true;
+}
+
+bool merkle_tree::load(const std::string& path, uint64_t sequence)
+{
+    std::ifstream file(path, std::ios::binary);
+    bcs::data_chunk header(merkle_file_header_size);
+    if (!file.read(reinterpret_cast<char*>(header.data()), header.size()))
+        return false;
+    auto deserial = bcs::make_unsafe_deserializer(header.begin());
+    if (deserial.read_4_bytes_little_endian() != merkle_file_magic ||
+        deserial.read_8_bytes_little_endian() != sequence)
+        return false;
+    const output_index_type size = deserial.read_4_bytes_little_endian();
+
+    std::vector<bcs::hash_list> levels(depth + 1);
+    for (size_t level = 0; level <= depth; ++level)
+    {
+        auto& nodes = levels[level];
+        nodes.resize(level_size(size, level));
+        if (!file.read(reinterpret_cast<char*>(nodes.data()),
+            nodes.size() * bcs::hash_size))
+            return false;
+    }
+    // Anything left over means the file is not ours
+    if (file.peek() != std::ifstream::traits_type::eof())
+        return false;
+
+    size_ = size;
+    levels_ = std::move(levels);
+    return true;
+}
+
+} // namespace dark
@@ -7,7 +7,9 @@ namespace dark {
 
 using json = nlohmann::json;
 
-message_client::message_client()
+message_client::message_client(const std::string& send_endpoint,
+    const std::string& receive_endpoint)
+  : send_endpoint_(send_endpoint), receive_endpoint_(receive_endpoint)
 {
 }
 message_client::~message_client()
@@ -21,7 +23,7 @@ void message_client::send(const std::string& message)
     if (!sender_socket_)
     {
         sender_socket_ = zsock_new(ZMQ_PUSH);
-        zsock_connect(sender_socket_, "tcp://localhost:8888");
+        zsock_connect(sender_socket_, "%s", send_endpoint_.c_str());
     }
     zstr_send(sender_socket_, message.data());
 }
@@ -31,7 +33,7 @@ std::string message_client::receive()
     if (!receiver_socket_)
     {
         receiver_socket_ = zsock_new(ZMQ_SUB);
-        zsock_connect(receiver_socket_, "tcp://localhost:8889");
+        zsock_connect(receiver_socket_, "%s", receive_endpoint_.c_str());
         zsock_set_subscribe(receiver_socket_, "");
         zsys_handler_set(NULL);
     }
@@ -1,20 +1,68 @@
 #include <dark/message_server.hpp>
 
-#include <iostream>
+#include <algorithm>
 #include <string>
+#include <dark/blockchain_snapshot.hpp>
+#include <dark/logger.hpp>
+#include <dark/metrics.hpp>
 #include <dark/utility.hpp>
 #include <dark/wallet.hpp>
 
 namespace dark {
 
-message_server::message_server(dark::blockchain& chain)
-  : chain_(chain)
+struct reject_reason_entry
 {
+    const char* label;
+    const char* message;
+};
+
+// In reject_reason order
+const reject_reason_entry reject_reasons[] =
+{
+    { "reason=\"duplicate_output\"", "Duplicate output. Rejecting tx" },
+    { "reason=\"invalid_output\"", "Invalid output. Rejecting tx" },
+    { "reason=\"invalid_input\"", "Invalid input. Rejecting tx" },
+    { "reason=\"excess\"", "Excess values do not sum. Rejecting tx" },
+    { "reason=\"signature\"", "Signature does not verify. Rejecting tx" },
+    { "reason=\"rangeproof\"", "Rangeproof failed. Rejecting tx" },
+    { "reason=\"spent_input\"", "Input spent before commit. Rejecting tx" }
+};
+
+// How long a blocked receive waits before checking for stop()
+constexpr int message_poll_ms = 100;
+
+histogram& validation_time(const char* stage)
+{
+    return server_metrics().histogram_for(
+        "message_validation_microseconds",
+        std::string("stage=\"") + stage + "\"");
+}
+
+message_server::message_server(chain_sequencer& sequencer,
+    const std::string& receive_bind, const std::string& publish_bind)
+  : sequencer_(sequencer),
+    chain_(sequencer.chain()),
+    outputs_time_(validation_time("outputs")),
+    inputs_time_(validation_time("inputs")),
+    excess_time_(validation_time("excess")),
+    signature_time_(validation_time("signature")),
+    rangeproof_time_(validation_time("rangeproof")),
+    commit_time_(server_metrics().histogram_for(
+        "message_commit_microseconds")),
+    group_size_(server_metrics().histogram_for("message_group_size")),
+    accepted_count_(server_metrics().counter_for(
+        "message_accepted_total"))
+{
+    for (size_t i = 0; i < rejected_count_.size(); ++i)
+        rejected_count_[i] = &server_metrics().counter_for(
+            "message_rejected_total", reject_reasons[i].label);
+
     receiver_socket_ = zsock_new(ZMQ_PULL);
-    zsock_bind(receiver_socket_, "tcp://*:8888");
+    zsock_set_rcvtimeo(receiver_socket_, message_poll_ms);
+    bind_endpoints(receiver_socket_, receive_bind);
 
     publish_socket_ = zsock_new(ZMQ_PUB);
-    zsock_bind(publish_socket_, "tcp://*:8889");
+    bind_endpoints(publish_socket_, publish_bind);
 }
 message_server::~message_server()
 {
@@ -24,117 +72,228 @@ message_server::~message_server()
 void message_server::start()
 {
     zsys_handler_set(NULL);
-    while (true)
+    while (!stopping_)
     {
-        char* message = zstr_recv(receiver_socket_);
-        std::string result(message);
-        free(message);
-
-        const auto response = json::parse(result);
-        if (response.count("command") && response["command"] == "broadcast")
-            accept_if_valid(response);
-        else
-            zstr_send(publish_socket_, result.data());
+        // Block for one message, then take whatever else is already
+        // queued so those broadcasts share a single chain commit.
+        blockchain_batch batch;
+        size_t received = 0;
+        do
+        {
+            char* message = zstr_recv(receiver_socket_);
+            // Timed out, so check for stop()
+            if (!message)
+                break;
+            std::string result(message);
+            free(message);
+
+            const auto response = json::parse(result);
+            if (response.count("command") &&
+                response["command"] == "broadcast")
+                accept_if_valid(response, batch);
+            else
+                zstr_send(publish_socket_, result.data());
+        } while (++received < max_group_size &&
+            (zsock_events(receiver_socket_) & ZMQ_POLLIN));
+        if (received == 0)
+            continue;
+        group_size_.record(received);
+
+        finalize();
     }
 }
+void message_server::stop()
+{
+    stopping_ = true;
+}
 
-void message_server::accept_if_valid(json response)
+bool message_server::accept_if_valid(json response, blockchain_batch& batch)
 {
     const auto tx = transaction_from_json(response);
 
-    // verify outputs and inputs
-    bcs::ec_point excess;
-    bool is_init = false;
-    for (const auto& output: tx.outputs)
+    pubkey_list output_keys, input_keys;
     {
-        if (!is_init)
+        scoped_timer timer(outputs_time_);
+
+        // reject outputs which are already on chain, staged by an
+        // earlier transaction of this batch or repeated in this one
+        for (auto it = tx.outputs.begin(); it != tx.outputs.end(); ++it)
+        {
+            const auto& point = it->output.point();
+            const auto same = [&point](const transaction_output& other)
+            {
+                return other.output.point() == point;
+            };
+            if (chain_.find(point) || batch.is_put(point) ||
+                std::any_of(tx.outputs.begin(), it, same))
+                return reject(reject_reason::duplicate_output);
+        }
+
+        // verify outputs
+        for (const auto& output: tx.outputs)
         {
-            is_init = true;
-            excess = output.output;
+            secp256k1_pubkey key;
+            if (!parse_point(key, output.output.point()))
+                return reject(reject_reason::invalid_output);
+            output_keys.push_back(key);
         }
-        else
-            excess += output.output;
     }
-    for (const auto input: tx.inputs)
     {
-        if (input >= chain_.count() || !chain_.exists(input))
+        scoped_timer timer(inputs_time_);
+
+        // One consistent view for every input read
+        const auto view = chain_.snapshot();
+        for (auto it = tx.inputs.begin(); it != tx.inputs.end(); ++it)
         {
-            std::cout << "Invalid input. Rejecting tx" << std::endl;
-            return;
+            const auto input = *it;
+            // Inputs spent earlier in this batch are already gone, and
+            // spending one twice would count its value twice.
+            if (input >= view->count() || !view->exists(input) ||
+                batch.is_removed(input) ||
+                std::find(tx.inputs.begin(), it, input) != it)
+                return reject(reject_reason::invalid_input);
+            // Usually created by a recent broadcast and still decompressed
+            secp256k1_pubkey key;
+            if (!input_points_.load(key, input, view->get(input).point))
+                return reject(reject_reason::invalid_input);
+            input_keys.push_back(key);
         }
-        auto result = chain_.get(input);
-        bcs::ec_compressed point;
-        std::copy(result, result + bcs::ec_compressed_size, point.begin());
-        excess -= point;
     }
-    if (tx.kernel.excess != excess)
     {
-        std::cout << "Excess values do not sum. Rejecting tx" << std::endl;
-        return;
-    }
+        scoped_timer timer(excess_time_);
 
-    // validate attached signature
-    if (!dark::verify(tx.kernel.signature, tx.kernel.excess))
-    {
-        std::cout << "Signature does not verify. Rejecting tx" << std::endl;
-        return;
+        bcs::ec_compressed excess;
+        if (!sum_points(excess, output_keys, input_keys) ||
+            tx.kernel.excess.point() != excess)
+            return reject(reject_reason::excess);
     }
+    {
+        scoped_timer timer(signature_time_);
 
-    // verify rangeproofs
-    for (const auto& output: tx.outputs)
+        // validate attached signature
+        if (!dark::verify(tx.kernel.signature, tx.kernel.excess))
+            return reject(reject_reason::signature);
+    }
     {
-        const auto& rangeproof = output.rangeproof;
+        scoped_timer timer(rangeproof_time_);
 
-        bcs::key_rings test_rings;
-        for (size_t i = 0; i < proofsize; ++i)
+        // verify rangeproofs
+        for (const auto& output: tx.outputs)
         {
-            const auto& commitment = rangeproof.commitments[i];
-            const uint64_t value_2i = std::pow(2, i);
-            test_rings.push_back({
-                commitment,
-                commitment - bcs::ec_scalar(value_2i) * dark::ec_point_H });
-        }
+            const auto& rangeproof = output.rangeproof;
 
-        // Verify rangeproof
-        if (!bcs::verify(test_rings, bcs::null_hash, rangeproof.signature))
-        {
-            std::cout << "Rangeproof failed. Rejecting tx" << std::endl;
-            return;
+            bcs::key_rings test_rings;
+            for (size_t i = 0; i < proofsize; ++i)
+            {
+                const auto& commitment = rangeproof.commitments[i];
+                const uint64_t value_2i = std::pow(2, i);
+                test_rings.push_back({
+                    commitment,
+                    commitment - bcs::ec_scalar(value_2i) * dark::ec_point_H });
+            }
+
+            // Verify rangeproof
+            if (!bcs::verify(test_rings, bcs::null_hash, rangeproof.signature))
+                return reject(reject_reason::rangeproof);
         }
     }
 
-    std::cout << "Accepting transaction..." << std::endl;
-
-    typedef std::vector<output_index_type> index_list;
-    index_list removed_indexes, added_indexes;
+    server_log().debug("Accepting transaction...");
 
+    accepted_transaction accepted{ response, tx.kernel, {}, {}, output_keys };
     for (const auto input: tx.inputs)
     {
-        BITCOIN_ASSERT(input < chain_.count());
-        BITCOIN_ASSERT(chain_.exists(input));
-        chain_.remove(input);
-        removed_indexes.push_back(input);
-        std::cout << "Removed #" << input << std::endl;
+        batch.remove(input);
+        accepted.removed.push_back(input);
     }
-    response["added"] = json::array();
     for (const auto& output: tx.outputs)
     {
-        auto index = chain_.put(output.output);
-        added_indexes.push_back(index);
-        std::cout << "Allocated #" << index << ": "
-            << bcs::encode_base16(output.output.point()) << std::endl;
-        response["added"].push_back({
-            {"index", index},
-            {"point", bcs::encode_base16(output.output.point())}
-        });
+        batch.put(output.output);
+        accepted.added.push_back(output.output);
     }
+    accepted_.push_back(accepted);
+    return true;
+}
 
-    response["command"] = "final";
-    response["removed"] = removed_indexes;
-    auto result = response.dump();
-    std::cout << "Final stage: " << response.dump(4) << std::endl;
-    zstr_send(publish_socket_, result.data());
+bool message_server::reject(reject_reason reason)
+{
+    const auto& entry = reject_reasons[static_cast<size_t>(reason)];
+    server_log().info(entry.message);
+    ++*rejected_count_[static_cast<size_t>(reason)];
+    return false;
 }
 
-} // namespace dark
+void message_server::finalize()
+{
+    if (accepted_.empty())
+        return;
+    scoped_timer timer(commit_time_);
+
+    // Submitted one by one so that a transaction whose inputs were spent
+    // since it was validated is rejected alone. The sequencer still
+    // merges them into one commit.
+    std::vector<std::future<boost::optional<output_index_list>>> commits;
+    for (const auto& accepted: accepted_)
+    {
+        blockchain_batch own;
+        for (const auto input: accepted.removed)
+            own.remove(input);
+        for (const auto& point: accepted.added)
+            own.put(point);
+        // Journaled by the commit handler before the future is ready
+        commits.push_back(sequencer_.submit(own, accepted.kernel));
+    }
+
+    accepted_list committed;
+    for (size_t i = 0; i < accepted_.size(); ++i)
+    {
+        auto& accepted = accepted_[i];
+        // Puts come back in staging order
+        const auto indexes = commits[i].get();
+        if (!indexes)
+        {
+            reject(reject_reason::spent_input);
+            continue;
+        }
+        ++accepted_count_;
+        auto& response = accepted.response;
+
+        for (const auto input: accepted.removed)
+        {
+            server_log().debug("Removed #%u", input);
+            input_points_.erase(input);
+        }
+
+        response["added"] = json::array();
+        auto key = accepted.added_keys.begin();
+        auto index = indexes->begin();
+        for (const auto& point: accepted.added)
+        {
+            BITCOIN_ASSERT(index != indexes->end());
+            // New outputs are the likeliest inputs of the next broadcasts
+            input_points_.insert(*index, point, *key++);
+            server_log().debug("Allocated #%u: %x", *index, point);
+            response["added"].push_back({
+                {"index", *index},
+                {"point", bcs::encode_base16(point)}
+            });
+            ++index;
+        }
+        committed.push_back(std::move(accepted));
+    }
+    accepted_.clear();
+
+    for (auto& accepted: committed)
+    {
+        auto& response = accepted.response;
 
+        response["command"] = "final";
+        response["removed"] = accepted.removed;
+        auto result = response.dump();
+        server_log().debug("Final stage: %u removed, %u added",
+            accepted.removed.size(), accepted.added.size());
+        zstr_send(publish_socket_, result.data());
+    }
+}
+
+} // namespace dark
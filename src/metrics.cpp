@@ -0,0 +1,195 @@
+#include <dark/metrics.hpp>
+
+#include <algorithm>
+#include <sstream>
+
+namespace dark {
+
+constexpr size_t histogram::buckets_count;
+
+// Buckets per power of two above the exact range
+constexpr size_t histogram_sub_bits = 3;
+constexpr size_t histogram_exact = 16;
+
+size_t highest_bit(uint64_t value)
+{
+    size_t bit = 0;
+    while (value >>= 1)
+        ++bit;
+    return bit;
+}
+
+size_t histogram::bucket_of(uint64_t value)
+{
+    if (value < histogram_exact)
+        return value;
+    const auto exponent = highest_bit(value);
+    const auto shift = exponent - histogram_sub_bits;
+    const auto sub = (value >> shift) & ((1 << histogram_sub_bits) - 1);
+    return histogram_exact + ((exponent - 4) << histogram_sub_bits) + sub;
+}
+
+uint64_t histogram::bucket_upper(size_t bucket)
+{
+    if (bucket < histogram_exact)
+        return bucket;
+    const auto offset = bucket - histogram_exact;
+    const auto shift = 4 + (offset >> histogram_sub_bits) - histogram_sub_bits;
+    const auto sub = offset & ((1 << histogram_sub_bits) - 1);
+    const auto lower = uint64_t((1 << histogram_sub_bits) + sub) << shift;
+    return lower + (uint64_t(1) << shift) - 1;
+}
+
+void histogram::record(uint64_t value)
+{
+    buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    auto highest = max_.load(std::memory_order_relaxed);
+    while (value > highest && !max_.compare_exchange_weak(highest, value,
+        std::memory_order_relaxed));
+}
+
+uint64_t histogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+uint64_t histogram::sum() const
+{
+    return sum_.load(std::memory_order_relaxed);
+}
+uint64_t histogram::max() const
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t histogram::quantile(double fraction) const
+{
+    // Buckets are read one by one, so use their own total
+    uint64_t total = 0;
+    for (const auto& bucket: buckets_)
+        total += bucket.load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+
+    const auto rank = static_cast<uint64_t>(fraction * (total - 1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets_count; ++i)
+    {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen > rank)
+            return std::min(bucket_upper(i), max());
+    }
+    return max();
+}
+
+scoped_timer::scoped_timer(histogram& target)
+  : target_(target), start_(std::chrono::steady_clock::now())
+{
+}
+scoped_timer::~scoped_timer()
+{
+    const auto elapsed = std::chrono::steady_clock::now() - start_;
+    target_.record(std::chrono::duration_cast<std::chrono::microseconds>(
+        elapsed).count());
+}
+
+template <typename Metric>
+Metric& find_or_add(std::map<std::pair<std::string, std::string>,
+    std::unique_ptr<Metric>>& metrics, const std::string& name,
+    const std::string& labels)
+{
+    auto& entry = metrics[{ name, labels }];
+    // Value initialized, so counters and gauges start at zero
+    if (!entry)
+        entry.reset(new Metric());
+    return *entry;
+}
+
+histogram& metrics::histogram_for(const std::string& name,
+    const std::string& labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find_or_add(histograms_, name, labels);
+}
+metric_counter& metrics::counter_for(const std::string& name,
+    const std::string& labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find_or_add(counters_, name, labels);
+}
+metric_gauge& metrics::gauge_for(const std::string& name,
+    const std::string& labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return find_or_add(gauges_, name, labels);
+}
+
+// name_suffix{labels,extra}
+std::string metric_line(const std::string& name, const char* suffix,
+    const std::string& labels, const std::string& extra = "")
+{
+    auto inside = labels;
+    if (!extra.empty())
+        inside += (inside.empty() ? "" : ",") + extra;
+    return name + suffix + (inside.empty() ? "" : "{" + inside + "}");
+}
+
+std::string metrics::text() const
+{
+    static const std::pair<const char*, double> quantiles[] =
+    {
+        { "0.5", 0.5 }, { "0.9", 0.9 }, { "0.99", 0.99 }, { "0.999", 0.999 }
+    };
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ostringstream out;
+    std::string previous;
+    for (const auto& entry: histograms_)
+    {
+        const auto& name = entry.first.first;
+        const auto& labels = entry.first.second;
+        const auto& values = *entry.second;
+        if (name != previous)
+            out << "# TYPE " << name << " summary\n";
+        previous = name;
+        for (const auto& quantile: quantiles)
+            out << metric_line(name, "", labels,
+                std::string("quantile=\"") + quantile.first + "\"") << " "
+                << values.quantile(quantile.second) << "\n";
+        out << metric_line(name, "_sum", labels) << " " << values.sum()
+            << "\n";
+        out << metric_line(name, "_count", labels) << " " << values.count()
+            << "\n";
+        out << metric_line(name, "_max", labels) << " " << values.max()
+            << "\n";
+    }
+    for (const auto& entry: counters_)
+    {
+        const auto& name = entry.first.first;
+        if (name != previous)
+            out << "# TYPE " << name << " counter\n";
+        previous = name;
+        out << metric_line(name, "", entry.first.second) << " "
+            << entry.second->load(std::memory_order_relaxed) << "\n";
+    }
+    for (const auto& entry: gauges_)
+    {
+        const auto& name = entry.first.first;
+        if (name != previous)
+            out << "# TYPE " << name << " gauge\n";
+        previous = name;
+        out << metric_line(name, "", entry.first.second) << " "
+            << entry.second->load(std::memory_order_relaxed) << "\n";
+    }
+    return out.str();
+}
+
+metrics& server_metrics()
+{
+    static metrics registry;
+    return registry;
+}
+
+} // namespace dark
+
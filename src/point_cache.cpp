@@ -0,0 +1,131 @@
+#include <dark/point_cache.hpp>
+
+namespace dark {
+
+// Parsing, negating and combining need no precomputed tables.
+const secp256k1_context* point_context()
+{
+    static const secp256k1_context* context =
+        secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
+    return context;
+}
+
+bool parse_point(secp256k1_pubkey& out, const bcs::ec_compressed& point)
+{
+    return secp256k1_ec_pubkey_parse(point_context(), &out,
+        point.data(), point.size()) == 1;
+}
+
+bool sum_points(bcs::ec_compressed& out, const pubkey_list& added,
+    const pubkey_list& removed)
+{
+    pubkey_list terms(added);
+    for (auto key: removed)
+    {
+        if (secp256k1_ec_pubkey_negate(point_context(), &key) != 1)
+            return false;
+        terms.push_back(key);
+    }
+    if (terms.empty())
+        return false;
+
+    std::vector<const secp256k1_pubkey*> pointers;
+    pointers.reserve(terms.size());
+    for (const auto& key: terms)
+        pointers.push_back(&key);
+
+    // Combining stays in Jacobian coordinates until the very end
+    secp256k1_pubkey result;
+    if (secp256k1_ec_pubkey_combine(point_context(), &result,
+        pointers.data(), pointers.size()) != 1)
+        return false;
+
+    size_t size = out.size();
+    secp256k1_ec_pubkey_serialize(point_context(), out.data(), &size,
+        &result, SECP256K1_EC_COMPRESSED);
+    BITCOIN_ASSERT(size == bcs::ec_compressed_size);
+    return true;
+}
+
+point_cache::point_cache(size_t capacity)
+  : capacity_(capacity)
+{
+    BITCOIN_ASSERT(capacity_ > 0);
+}
+
+bool point_cache::load(secp256k1_pubkey& out, output_index_type index,
+    const bcs::ec_compressed& point)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto it = lookup_.find(index);
+        if (it != lookup_.end() && it->second->point == point)
+        {
+            entries_.splice(entries_.begin(), entries_, it->second);
+            out = it->second->key;
+            ++hits_;
+            return true;
+        }
+        ++misses_;
+    }
+
+    // Decompress outside the lock
+    if (!parse_point(out, point))
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert_locked(index, point, out);
+    return true;
+}
+
+void point_cache::insert(output_index_type index,
+    const bcs::ec_compressed& point, const secp256k1_pubkey& key)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    insert_locked(index, point, key);
+}
+
+void point_cache::insert_locked(output_index_type index,
+    const bcs::ec_compressed& point, const secp256k1_pubkey& key)
+{
+    const auto it = lookup_.find(index);
+    if (it != lookup_.end())
+    {
+        it->second->point = point;
+        it->second->key = key;
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return;
+    }
+
+    if (entries_.size() == capacity_)
+    {
+        lookup_.erase(entries_.back().index);
+        entries_.pop_back();
+    }
+    entries_.push_front({ index, point, key });
+    lookup_[index] = entries_.begin();
+}
+
+void point_cache::erase(output_index_type index)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = lookup_.find(index);
+    if (it == lookup_.end())
+        return;
+    entries_.erase(it->second);
+    lookup_.erase(it);
+}
+
+size_t point_cache::hits() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+size_t point_cache::misses() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+} // namespace dark
+
@@ -0,0 +1,96 @@
+#include "test.hpp"
+
+#include <chrono>
+#include <map>
+#include <thread>
+#include <dark/chain_feed.hpp>
+#include <dark/chain_sequencer.hpp>
+
+namespace dark {
+namespace test {
+
+void test_sequenced_deltas()
+{
+    const std::string endpoint = "inproc://darktech-test-feed";
+    blockchain chain(scratch_path("feed").c_str(), 3);
+    chain_feed feed(endpoint);
+    chain_feed_subscriber subscriber(endpoint);
+    // Subscriptions reach the publisher asynchronously
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    boost::optional<output_index_list> first, second;
+    {
+        // Published from the writer as the server does
+        chain_sequencer sequencer(chain);
+        sequencer.set_commit_handler(
+            [&](const sequenced_batch_list& committed)
+        {
+            for (const auto& item: committed)
+                feed.publish(item, item.indexes.empty() ? 0 :
+                    chain.get(item.indexes.front()).time);
+        });
+
+        blockchain_batch puts;
+        for (uint32_t n = 0; n < 5; ++n)
+            puts.put(test_point(n));
+        first = sequencer.commit(puts);
+        DARK_CHECK(first && first->size() == 5);
+        if (!first || first->size() != 5)
+            return;
+
+        blockchain_batch mixed;
+        mixed.remove((*first)[1]);
+        mixed.remove((*first)[3]);
+        mixed.put(test_point(5));
+        second = sequencer.commit(mixed);
+        DARK_CHECK(second && second->size() == 1);
+        if (!second || second->size() != 1)
+            return;
+
+        // Rejected batches never reach subscribers
+        blockchain_batch spent;
+        spent.remove((*first)[1]);
+        DARK_CHECK(!sequencer.commit(spent));
+    }
+
+    std::map<output_index_type, bcs::ec_compressed> mirror;
+    chain_delta delta;
+    DARK_CHECK(subscriber.receive(delta));
+    DARK_CHECK(delta.sequence == 1 && delta.removed.empty());
+    DARK_CHECK(delta.time == chain.get((*first)[0]).time);
+    DARK_CHECK(delta.added.size() == 5);
+    for (size_t i = 0; i < delta.added.size() && i < 5; ++i)
+    {
+        DARK_CHECK(delta.added[i].index == (*first)[i]);
+        DARK_CHECK(delta.added[i].point == test_point(i));
+        mirror[delta.added[i].index] = delta.added[i].point;
+    }
+
+    DARK_CHECK(subscriber.receive(delta));
+    DARK_CHECK(delta.sequence == 2);
+    DARK_CHECK(delta.removed ==
+        output_index_list({ (*first)[1], (*first)[3] }));
+    DARK_CHECK(delta.added.size() == 1 &&
+        delta.added[0].index == (*second)[0] &&
+        delta.added[0].point == test_point(5));
+    for (const auto index: delta.removed)
+        mirror.erase(index);
+    for (const auto& output: delta.added)
+        mirror[output.index] = output.point;
+    DARK_CHECK(subscriber.missed() == 0);
+
+    // Applying the deltas in order mirrors the chain
+    DARK_CHECK(mirror.size() == chain.live_count());
+    for (const auto& entry: mirror)
+        DARK_CHECK(chain.exists(entry.first) &&
+            chain.get(entry.first).point == entry.second);
+}
+
+void feed_tests()
+{
+    test_sequenced_deltas();
+}
+
+} // namespace test
+} // namespace dark
+
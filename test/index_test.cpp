@@ -0,0 +1,165 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <boost/filesystem.hpp>
+#include <dark/blockchain_snapshot.hpp>
+#include <dark/kernel_journal.hpp>
+
+namespace dark {
+namespace test {
+
+namespace fs = boost::filesystem;
+
+// Every output is found at its index while unspent and not at all once
+// spent.
+void check_found(const blockchain& chain, const output_index_list& indexes,
+    uint32_t spent_every)
+{
+    for (uint32_t n = 0; n < indexes.size(); ++n)
+    {
+        const auto index = chain.find(test_point(n));
+        if (n % spent_every == 0)
+            DARK_CHECK(!index);
+        else
+            DARK_CHECK(index && *index == indexes[n]);
+    }
+    DARK_CHECK(!chain.find(test_point(indexes.size())));
+}
+
+void test_commitment_index()
+{
+    constexpr size_t shards = 4;
+    constexpr uint32_t outputs = 3000;
+    constexpr uint32_t spent_every = 5;
+    const auto path = scratch_path("commitments");
+    output_index_list indexes;
+    {
+        blockchain chain(path.c_str(), shards);
+        blockchain_batch puts;
+        for (uint32_t n = 0; n < outputs; ++n)
+            puts.put(test_point(n));
+        const auto added = chain.commit(puts);
+        DARK_CHECK(added && added->size() == outputs);
+        if (!added || added->size() != outputs)
+            return;
+        indexes = *added;
+
+        blockchain_batch removes;
+        for (uint32_t n = 0; n < outputs; n += spent_every)
+            removes.remove(indexes[n]);
+        DARK_CHECK(bool(chain.commit(removes)));
+        check_found(chain, indexes, spent_every);
+    }
+
+    // Reopened from the index files as they were left
+    {
+        blockchain chain(path.c_str());
+        check_found(chain, indexes, spent_every);
+    }
+
+    // Rebuilt from the records when the index files are missing
+    for (size_t shard = 0; shard < shards; ++shard)
+        DARK_CHECK(fs::remove(fs::path(path) /
+            ("index." + std::to_string(shard))));
+    {
+        blockchain chain(path.c_str());
+        check_found(chain, indexes, spent_every);
+
+        // And kept up to date from there on
+        const auto index = chain.put(test_point(outputs));
+        DARK_CHECK(chain.find(test_point(outputs)) == index);
+    }
+}
+
+// The indexes in any order.
+output_index_list sorted(output_index_list indexes)
+{
+    std::sort(indexes.begin(), indexes.end());
+    return indexes;
+}
+
+void test_time_index()
+{
+    // Rebuilt from a journal so every output has a known creation time,
+    // two to each of 1000, 1010, 1020, 1030 and 1040.
+    const auto journal_path = scratch_path("timed_kernels");
+    const auto path = scratch_path("timed");
+    {
+        kernel_journal journal(journal_path);
+        for (uint32_t n = 0; n < 10; ++n)
+        {
+            kernel_entry entry;
+            entry.time = 1000 + 10 * (n / 2);
+            entry.added.push_back({ n, test_point(n) });
+            journal.append(entry);
+        }
+    }
+    DARK_CHECK(kernel_journal::rebuild(journal_path, path.c_str()));
+    blockchain chain(path.c_str());
+    const auto times_of = [&chain](const output_index_list& indexes)
+    {
+        std::vector<uint32_t> times;
+        for (const auto index: indexes)
+            times.push_back(chain.get(index).time);
+        return times;
+    };
+
+    const auto view = chain.snapshot();
+    // From is inclusive and to exclusive
+    DARK_CHECK(view->created_between(1000, 1000).empty());
+    DARK_CHECK(view->created_between(0, 1000).empty());
+    DARK_CHECK(view->created_between(1041, 2000).empty());
+    DARK_CHECK(view->created_between(1020, 1010).empty());
+    DARK_CHECK(sorted(view->created_between(1000, 1010)) ==
+        output_index_list({ 0, 1 }));
+    DARK_CHECK(sorted(view->created_between(1010, 1031)) ==
+        output_index_list({ 2, 3, 4, 5, 6, 7 }));
+    const auto all = view->created_between(0,
+        std::numeric_limits<uint32_t>::max());
+    DARK_CHECK(all.size() == 10);
+    const auto all_times = times_of(all);
+    DARK_CHECK(std::is_sorted(all_times.begin(), all_times.end()));
+
+    DARK_CHECK(view->newest(0).empty());
+    DARK_CHECK(view->newest(100).size() == 10);
+    const auto newest = view->newest(3);
+    DARK_CHECK(newest.size() == 3 &&
+        times_of(newest) == std::vector<uint32_t>({ 1040, 1040, 1030 }));
+
+    // Spent outputs drop out of later snapshots only
+    blockchain_batch removes;
+    removes.remove(1);
+    removes.remove(8);
+    removes.remove(9);
+    DARK_CHECK(bool(chain.commit(removes)));
+    {
+        const auto now = chain.snapshot();
+        DARK_CHECK(now->created_between(1000, 1010) ==
+            output_index_list({ 0 }));
+        DARK_CHECK(now->created_between(1040, 1041).empty());
+        DARK_CHECK(now->created_between(0, 1050).size() == 7);
+        DARK_CHECK(times_of(now->newest(2)) ==
+            std::vector<uint32_t>({ 1030, 1030 }));
+    }
+    DARK_CHECK(sorted(view->created_between(1000, 1010)) ==
+        output_index_list({ 0, 1 }));
+    DARK_CHECK(sorted(view->newest(2)) == output_index_list({ 8, 9 }));
+
+    // Commits never go back before the newest time in the index
+    const auto index = chain.put(test_point(10));
+    DARK_CHECK(chain.get(index).time >= 1040);
+    const auto latest = chain.snapshot();
+    DARK_CHECK(latest->newest(1) == output_index_list({ index }));
+    DARK_CHECK(latest->created_between(0, 1041).size() == 7);
+}
+
+void index_tests()
+{
+    test_commitment_index();
+    test_time_index();
+}
+
+} // namespace test
+} // namespace dark
+
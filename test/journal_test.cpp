@@ -0,0 +1,286 @@
+#include "test.hpp"
+
+#include <fstream>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include <dark/kernel_journal.hpp>
+
+namespace dark {
+namespace test {
+
+namespace fs = boost::filesystem;
+
+// Sum of the points of a chain holding only those outputs.
+boost::optional<bcs::ec_compressed> expected_sum(
+    const std::vector<uint32_t>& points)
+{
+    blockchain chain(scratch_path("expected").c_str());
+    blockchain_batch batch;
+    for (const auto n: points)
+        batch.put(test_point(n));
+    DARK_CHECK(bool(chain.commit(batch)));
+    return chain.commitment_sum();
+}
+
+void check_recovered(blockchain& chain)
+{
+    std::vector<uint32_t> points;
+    for (uint32_t n = 0; n < 30; ++n)
+        if (n != 2)
+            points.push_back(n);
+
+    DARK_CHECK(chain.live_count() == points.size());
+    for (uint32_t n = 0; n < 30; ++n)
+        DARK_CHECK(bool(chain.find(test_point(n))) == (n != 2));
+    DARK_CHECK(chain.commitment_sum() == expected_sum(points));
+    DARK_CHECK(chain.verify().bad.empty());
+
+    // Spent slots are reused, each only once
+    const auto first = chain.put(test_point(100));
+    const auto second = chain.put(test_point(101));
+    DARK_CHECK(first != second);
+    DARK_CHECK(chain.live_count() == points.size() + 2);
+}
+
+// Commits in a child which exits with the chain still open, as if the
+// process died right after the commit.
+void commit_then_crash(const std::string& path, durability_mode mode)
+{
+    const auto child = fork();
+    if (child == 0)
+    {
+        blockchain chain(path.c_str());
+        durability_policy durability;
+        durability.mode = mode;
+        chain.set_durability(durability);
+
+        blockchain_batch batch;
+        batch.remove(*chain.find(test_point(2)));
+        for (uint32_t n = 10; n < 30; ++n)
+            batch.put(test_point(n));
+        _exit(chain.commit(batch) ? 0 : 1);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    DARK_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void test_chain_journal_replay()
+{
+    const auto path = scratch_path("replay");
+    {
+        blockchain chain(path.c_str(), 3);
+        for (uint32_t n = 0; n < 10; ++n)
+            chain.put(test_point(n));
+    }
+    commit_then_crash(path, durability_mode::commit);
+
+    blockchain chain(path.c_str());
+    check_recovered(chain);
+}
+
+void test_unclean_open_rebuilds()
+{
+    const auto path = scratch_path("unclean");
+    {
+        blockchain chain(path.c_str(), 3);
+        for (uint32_t n = 0; n < 10; ++n)
+            chain.put(test_point(n));
+    }
+    commit_then_crash(path, durability_mode::none);
+
+    // The frame never reached the disk, and neither did the sidecars
+    fs::resize_file(fs::path(path) / "journal", 8);
+    const auto live_size = fs::file_size(fs::path(path) / "live");
+    {
+        std::fstream live((fs::path(path) / "live").native(),
+            std::ios::binary | std::ios::in | std::ios::out);
+        live.write(std::string(live_size, '\0').data(), live_size);
+        std::fstream sum((fs::path(path) / "sum").native(),
+            std::ios::binary | std::ios::in | std::ios::out);
+        sum.write(std::string(bcs::ec_compressed_size, '\0').data(),
+            bcs::ec_compressed_size);
+    }
+
+    blockchain chain(path.c_str());
+    check_recovered(chain);
+}
+
+kernel_entry make_entry(uint32_t n)
+{
+    transaction_kernel kernel;
+    kernel.fee = n;
+    kernel.excess = test_point(n);
+    kernel.signature.witness = test_point(n + 1000);
+    kernel.signature.response = bcs::ec_scalar(uint64_t(n) + 1);
+
+    kernel_entry entry;
+    entry.time = 1000 + n;
+    entry.kernel = kernel;
+    if (n > 0)
+        entry.removed.push_back(2 * n - 1);
+    entry.added.push_back({ 2 * n, test_point(2 * n) });
+    entry.added.push_back({ 2 * n + 1, test_point(2 * n + 1) });
+    return entry;
+}
+
+bool same_entry(const kernel_entry& left, const kernel_entry& right)
+{
+    if (left.sequence != right.sequence || left.time != right.time ||
+        left.removed != right.removed ||
+        left.added.size() != right.added.size() ||
+        bool(left.kernel) != bool(right.kernel))
+        return false;
+    for (size_t i = 0; i < left.added.size(); ++i)
+        if (left.added[i].index != right.added[i].index ||
+            left.added[i].point != right.added[i].point)
+            return false;
+    if (!left.kernel)
+        return true;
+    return left.kernel->fee == right.kernel->fee &&
+        left.kernel->excess.point() == right.kernel->excess.point() &&
+        left.kernel->signature.witness.point() ==
+            right.kernel->signature.witness.point() &&
+        left.kernel->signature.response.secret() ==
+            right.kernel->signature.response.secret();
+}
+
+void test_kernel_journal_round_trip()
+{
+    const auto path = scratch_path("kernels");
+    // Small segments so the entries span several files
+    constexpr size_t segment_size = 2000;
+    std::vector<kernel_entry> entries;
+    {
+        kernel_journal journal(path, segment_size);
+        for (uint32_t n = 0; n < 100; ++n)
+        {
+            auto entry = make_entry(n);
+            journal.append(entry);
+            DARK_CHECK(entry.sequence == n);
+            entries.push_back(entry);
+        }
+        // Plain puts and removes carry no kernel
+        kernel_entry plain;
+        plain.time = 5;
+        plain.removed.push_back(199);
+        plain.added.push_back({ 200, test_point(200) });
+        journal.append(plain);
+        entries.push_back(plain);
+        journal.flush();
+    }
+    DARK_CHECK(fs::exists(fs::path(path) / "segment.000001"));
+
+    const auto check_entries = [&entries, &path]
+    {
+        kernel_journal journal(path, segment_size);
+        DARK_CHECK(journal.count() == entries.size());
+        for (const auto& expected: entries)
+        {
+            kernel_entry entry;
+            DARK_CHECK(journal.read(expected.sequence, entry) &&
+                same_entry(entry, expected));
+        }
+        uint64_t next = 90;
+        journal.for_each(90, [&](const kernel_entry& entry)
+        {
+            DARK_CHECK(same_entry(entry, entries[next++]));
+            return true;
+        });
+        DARK_CHECK(next == entries.size());
+    };
+    check_entries();
+
+    // The index is rebuilt from the segments
+    fs::remove(fs::path(path) / "index");
+    check_entries();
+
+    // A torn entry at the end is dropped
+    entries.pop_back();
+    std::string last;
+    for (fs::directory_iterator it(path); it != fs::directory_iterator();
+        ++it)
+        if (it->path().filename().native().compare(0, 8, "segment.") == 0)
+            last = std::max(last, it->path().native());
+    fs::resize_file(last, fs::file_size(last) - 5);
+    check_entries();
+}
+
+void test_kernel_journal_rebuild()
+{
+    const auto path = scratch_path("plain_kernels");
+    const auto chain_path = scratch_path("rebuilt");
+    constexpr size_t shards = 3;
+    // Journaled the way the server does, from the chain's own commits
+    std::vector<output_index_type> indexes;
+    {
+        blockchain source(scratch_path("journaled").c_str(), shards);
+        kernel_journal journal(path);
+        for (uint32_t n = 0; n < 50; ++n)
+        {
+            blockchain_batch batch;
+            if (n > 0)
+                batch.remove(indexes.back());
+            batch.put(test_point(2 * n));
+            batch.put(test_point(2 * n + 1));
+            const auto added = source.commit(batch);
+            DARK_CHECK(added && added->size() == 2);
+            if (!added || added->size() != 2)
+                return;
+
+            kernel_entry entry;
+            entry.time = 1000 + n;
+            entry.removed = batch.removes();
+            for (size_t i = 0; i < added->size(); ++i)
+                entry.added.push_back({ (*added)[i], batch.puts()[i] });
+            journal.append(entry);
+            indexes.insert(indexes.end(), added->begin(), added->end());
+        }
+    }
+
+    // Another shard count would file outputs where find() never looks
+    DARK_CHECK(!kernel_journal::rebuild(path, chain_path.c_str(), 2));
+    DARK_CHECK(!fs::exists(chain_path));
+
+    DARK_CHECK(kernel_journal::rebuild(path, chain_path.c_str(), shards));
+    {
+        blockchain chain(chain_path.c_str());
+        DARK_CHECK(chain.shards_count() == shards);
+        DARK_CHECK(chain.live_count() == 51);
+        for (uint32_t n = 0; n < 100; ++n)
+        {
+            const auto index = chain.find(test_point(n));
+            const auto live = n % 2 == 0 || n == 99;
+            DARK_CHECK(bool(index) == live);
+            DARK_CHECK(!index || *index == indexes[n]);
+        }
+        DARK_CHECK(chain.get(indexes[99]).time == 1049);
+    }
+    // Never over an existing chain
+    DARK_CHECK(!kernel_journal::rebuild(path, chain_path.c_str(), shards));
+
+    // A kernel whose signature does not verify stops the rebuild
+    {
+        kernel_journal journal(path);
+        auto entry = make_entry(60);
+        entry.removed.clear();
+        entry.added.clear();
+        journal.append(entry);
+    }
+    fs::remove_all(chain_path);
+    DARK_CHECK(!kernel_journal::rebuild(path, chain_path.c_str(), shards));
+    DARK_CHECK(!fs::exists(chain_path));
+}
+
+void journal_tests()
+{
+    test_chain_journal_replay();
+    test_unclean_open_rebuilds();
+    test_kernel_journal_round_trip();
+    test_kernel_journal_rebuild();
+}
+
+} // namespace test
+} // namespace dark
+
@@ -0,0 +1,62 @@
+#include "test.hpp"
+
+#include <iostream>
+#include <boost/filesystem.hpp>
+
+namespace dark {
+namespace test {
+
+namespace fs = boost::filesystem;
+
+size_t failed_checks = 0;
+
+void check(bool passed, const char* expression, const char* file,
+    int line)
+{
+    if (passed)
+        return;
+    std::cerr << file << ":" << line << ": check failed: " << expression
+        << std::endl;
+    ++failed_checks;
+}
+
+size_t failures()
+{
+    return failed_checks;
+}
+
+bcs::ec_compressed test_point(uint32_t n)
+{
+    return (bcs::ec_scalar(uint64_t(n) + 1) * bcs::ec_point::G).point();
+}
+
+std::string scratch_path(const std::string& name)
+{
+    auto path = fs::temp_directory_path() / "darktech_test" / name;
+    fs::remove_all(path);
+    fs::create_directories(path.parent_path());
+    return path.native();
+}
+
+} // namespace test
+} // namespace dark
+
+int main()
+{
+    using namespace dark::test;
+    feed_tests();
+    index_tests();
+    journal_tests();
+    merkle_tests();
+    sequencer_tests();
+    snapshot_tests();
+
+    if (failures() != 0)
+    {
+        std::cerr << failures() << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}
+
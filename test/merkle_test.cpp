@@ -0,0 +1,101 @@
+#include "test.hpp"
+
+#include <dark/merkle_tree.hpp>
+
+namespace dark {
+namespace test {
+
+// Whether the chain proves the index holds the record, or that it is
+// empty for none, against its current state root.
+bool proves(const blockchain& chain, output_index_type index,
+    const boost::optional<output_record>& record)
+{
+    const auto proof = chain.state_proof(index);
+    if (!proof || proof->root != chain.state_root())
+        return false;
+    const auto leaf = record ?
+        merkle_tree::leaf_hash(index, *record) : bcs::null_hash;
+    return merkle_tree::verify(*proof, leaf);
+}
+
+void test_state_proofs()
+{
+    constexpr size_t shards = 3;
+    const auto path = scratch_path("merkle");
+    blockchain chain(path.c_str(), shards);
+    blockchain_batch puts;
+    for (uint32_t n = 0; n < 20; ++n)
+        puts.put(test_point(n));
+    const auto indexes = chain.commit(puts);
+    DARK_CHECK(indexes && indexes->size() == 20);
+    if (!indexes || indexes->size() != 20)
+        return;
+    for (const auto index: *indexes)
+        DARK_CHECK(proves(chain, index, chain.get(index)));
+    DARK_CHECK(!chain.state_proof(chain.count()));
+
+    // Once spent the old leaf no longer verifies, only the empty one
+    const auto spent = (*indexes)[7];
+    const auto record = chain.get(spent);
+    const auto before = chain.state_root();
+    blockchain_batch remove;
+    remove.remove(spent);
+    DARK_CHECK(bool(chain.commit(remove)));
+    const auto emptied = chain.state_root();
+    DARK_CHECK(emptied != before);
+    DARK_CHECK(!proves(chain, spent, record));
+    DARK_CHECK(proves(chain, spent, boost::none));
+    for (const auto index: *indexes)
+        if (index != spent)
+            DARK_CHECK(proves(chain, index, chain.get(index)));
+
+    // A put into the same shard takes the slot back
+    uint32_t n = 100;
+    while (blockchain::shard_for(test_point(n), shards) != spent % shards)
+        ++n;
+    const auto reused = chain.put(test_point(n));
+    DARK_CHECK(reused == spent);
+    DARK_CHECK(proves(chain, spent, chain.get(spent)));
+    DARK_CHECK(!proves(chain, spent, record));
+    DARK_CHECK(!proves(chain, spent, boost::none));
+
+    // Spending it again leaves the slot empty as before
+    DARK_CHECK(bool(chain.commit(remove)));
+    DARK_CHECK(proves(chain, spent, boost::none));
+    DARK_CHECK(chain.state_root() == emptied);
+}
+
+void test_state_root_reopen()
+{
+    const auto path = scratch_path("merkle_reopen");
+    bcs::hash_digest root;
+    output_index_list indexes;
+    {
+        blockchain chain(path.c_str(), 2);
+        for (uint32_t n = 0; n < 10; ++n)
+            indexes.push_back(chain.put(test_point(n)));
+        blockchain_batch remove;
+        remove.remove(indexes[3]);
+        DARK_CHECK(bool(chain.commit(remove)));
+        root = chain.state_root();
+    }
+    blockchain chain(path.c_str());
+    DARK_CHECK(chain.state_root() == root);
+    for (size_t i = 0; i < indexes.size(); ++i)
+    {
+        if (i == 3)
+            DARK_CHECK(proves(chain, indexes[i], boost::none));
+        else
+            DARK_CHECK(proves(chain, indexes[i], chain.get(indexes[i])));
+    }
+}
+
+void merkle_tests()
+{
+    test_state_proofs();
+    test_state_root_reopen();
+}
+
+} // namespace test
+} // namespace dark
+
@@ -0,0 +1,161 @@
+#include "test.hpp"
+
+#include <mutex>
+#include <set>
+#include <thread>
+#include <dark/chain_sequencer.hpp>
+
+namespace dark {
+namespace test {
+
+void test_concurrent_submitters()
+{
+    blockchain chain(scratch_path("sequencer").c_str(), 2);
+    durability_policy durability;
+    durability.mode = durability_mode::none;
+    chain.set_durability(durability);
+
+    constexpr uint32_t threads = 8;
+    constexpr uint32_t rounds = 200;
+    std::mutex mutex;
+    std::set<output_index_type> kept;
+    {
+        chain_sequencer sequencer(chain);
+        std::vector<std::thread> submitters;
+        for (uint32_t thread = 0; thread < threads; ++thread)
+            submitters.emplace_back([&, thread]
+            {
+                for (uint32_t round = 0; round < rounds; ++round)
+                {
+                    const auto n = 2 * (thread * rounds + round);
+                    blockchain_batch batch;
+                    batch.put(test_point(n));
+                    batch.put(test_point(n + 1));
+                    const auto indexes = sequencer.commit(batch);
+                    DARK_CHECK(indexes && indexes->size() == 2);
+                    if (!indexes || indexes->size() != 2)
+                        continue;
+                    // Indexes come back in staging order
+                    DARK_CHECK(chain.get((*indexes)[0]).point ==
+                        test_point(n));
+                    DARK_CHECK(chain.get((*indexes)[1]).point ==
+                        test_point(n + 1));
+                    DARK_CHECK(sequencer.remove((*indexes)[1]));
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    DARK_CHECK(kept.insert((*indexes)[0]).second);
+                }
+            });
+        for (auto& submitter: submitters)
+            submitter.join();
+
+        // Still queued when the sequencer goes, and committed anyway
+        for (uint32_t n = 0; n < 100; ++n)
+        {
+            blockchain_batch batch;
+            batch.put(test_point(1000000 + n));
+            sequencer.submit(batch);
+        }
+    }
+    DARK_CHECK(chain.live_count() == threads * rounds + 100);
+    DARK_CHECK(bool(chain.find(test_point(1000099))));
+}
+
+void test_rejected_submissions()
+{
+    blockchain chain(scratch_path("rejected").c_str(), 2);
+    {
+        chain_sequencer sequencer(chain);
+        for (uint32_t n = 0; n < 10; ++n)
+            sequencer.put(test_point(n));
+        DARK_CHECK(sequencer.remove(3));
+        DARK_CHECK(!sequencer.remove(3));
+
+        // Rejected ones leave the rest of their group to commit
+        typedef std::future<boost::optional<output_index_list>> commit_future;
+        std::vector<commit_future> commits;
+        for (uint32_t round = 0; round < 50; ++round)
+        {
+            blockchain_batch good, bad, other;
+            good.put(test_point(100 + round));
+            bad.remove(1000000);
+            bad.put(test_point(200 + round));
+            other.put(test_point(300 + round));
+            commits.push_back(sequencer.submit(good));
+            commits.push_back(sequencer.submit(bad));
+            commits.push_back(sequencer.submit(other));
+        }
+        for (size_t i = 0; i < commits.size(); ++i)
+        {
+            const auto indexes = commits[i].get();
+            DARK_CHECK(bool(indexes) == (i % 3 != 1));
+            DARK_CHECK(!indexes || indexes->size() == 1);
+        }
+
+        // Of two spends of one output only the first commits
+        blockchain_batch spend;
+        spend.remove(5);
+        auto first = sequencer.submit(spend);
+        auto second = sequencer.submit(spend);
+        DARK_CHECK(first.get() && !second.get());
+    }
+    DARK_CHECK(!chain.find(test_point(200)) && !chain.find(test_point(249)));
+    DARK_CHECK(chain.find(test_point(100)) && chain.find(test_point(349)));
+    DARK_CHECK(chain.live_count() == 8 + 100);
+}
+
+void test_commit_handler()
+{
+    blockchain chain(scratch_path("handler").c_str(), 2);
+    std::mutex mutex;
+    std::set<output_index_type> handled;
+    size_t batches = 0, removes = 0;
+    {
+        chain_sequencer sequencer(chain);
+        sequencer.set_commit_handler(
+            [&](const sequenced_batch_list& committed)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& item: committed)
+            {
+                ++batches;
+                removes += item.batch.removes().size();
+                DARK_CHECK(item.batch.puts_count() == item.indexes.size());
+                for (size_t i = 0; i < item.indexes.size(); ++i)
+                    DARK_CHECK(chain.get(item.indexes[i]).point ==
+                        item.batch.puts()[i]);
+                handled.insert(item.indexes.begin(), item.indexes.end());
+            }
+        });
+
+        std::vector<std::thread> submitters;
+        for (uint32_t thread = 0; thread < 4; ++thread)
+            submitters.emplace_back([&, thread]
+            {
+                for (uint32_t n = 0; n < 50; ++n)
+                {
+                    const auto index = sequencer.put(
+                        test_point(thread * 100 + n));
+                    // Handled before the submitter hears of it
+                    std::lock_guard<std::mutex> lock(mutex);
+                    DARK_CHECK(handled.count(index) == 1);
+                }
+            });
+        for (auto& submitter: submitters)
+            submitter.join();
+        DARK_CHECK(sequencer.remove(*handled.begin()));
+    }
+    DARK_CHECK(batches == 201 && removes == 1);
+    DARK_CHECK(handled.size() == 200);
+}
+
+void sequencer_tests()
+{
+    test_concurrent_submitters();
+    test_rejected_submissions();
+    test_commit_handler();
+}
+
+} // namespace test
+} // namespace dark
+
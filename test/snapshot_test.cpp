@@ -0,0 +1,279 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <boost/filesystem.hpp>
+#include <dark/blockchain_snapshot.hpp>
+
+namespace dark {
+namespace test {
+
+namespace fs = boost::filesystem;
+
+typedef std::map<output_index_type, output_record> record_map;
+
+record_map live_records(const blockchain_snapshot& view,
+    output_index_type first, output_index_type last)
+{
+    record_map result;
+    view.for_each_live(first, last,
+        [&result](output_index_type index, const output_record& record)
+    {
+        // Handed out in ascending index order
+        DARK_CHECK(result.empty() || index > result.rbegin()->first);
+        result[index] = record;
+    });
+    return result;
+}
+
+void test_snapshot_file_round_trip(size_t shards, record_layout layout)
+{
+    const auto path = scratch_path("original");
+    const auto copy_path = scratch_path("copy");
+    const auto file_path = scratch_path("snapshot");
+
+    bcs::hash_digest root;
+    output_index_list removed;
+    {
+        blockchain chain(path.c_str(), shards, layout);
+        blockchain_batch puts;
+        for (uint32_t n = 0; n < 5000; ++n)
+            puts.put(test_point(n));
+        DARK_CHECK(bool(chain.commit(puts)));
+        blockchain_batch removes;
+        for (uint32_t n = 0; n < 5000; n += 7)
+        {
+            removed.push_back(*chain.find(test_point(n)));
+            removes.remove(removed.back());
+        }
+        DARK_CHECK(bool(chain.commit(removes)));
+
+        const auto view = chain.snapshot();
+        root = chain.state_root();
+        // Not part of the snapshot
+        chain.put(test_point(999999));
+        DARK_CHECK(view->write_file(file_path));
+        DARK_CHECK(!fs::exists(file_path + ".new"));
+    }
+
+    DARK_CHECK(blockchain::import_file(file_path.c_str(), copy_path.c_str()));
+    DARK_CHECK(!blockchain::import_file(file_path.c_str(),
+        copy_path.c_str()));
+    {
+        blockchain original(path.c_str()), copy(copy_path.c_str());
+        DARK_CHECK(copy.shards_count() == shards && copy.layout() == layout);
+        DARK_CHECK(copy.live_count() == original.live_count() - 1);
+        DARK_CHECK(!copy.find(test_point(999999)));
+        for (uint32_t n = 0; n < 5000; ++n)
+        {
+            const auto index = original.find(test_point(n));
+            DARK_CHECK(index == copy.find(test_point(n)));
+            if (index)
+                DARK_CHECK(original.get(*index).time ==
+                    copy.get(*index).time);
+        }
+        DARK_CHECK(copy.state_root() == root);
+        DARK_CHECK(copy.verify().bad.empty());
+
+        // Spent slots are free in the copy too
+        const auto index = copy.put(test_point(123456));
+        DARK_CHECK(std::find(removed.begin(), removed.end(), index) !=
+            removed.end() || index >= original.count());
+    }
+
+    // A corrupt file is refused and leaves nothing behind
+    {
+        std::fstream file(file_path,
+            std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(1000);
+        file.put(0x55);
+    }
+    fs::remove_all(copy_path);
+    DARK_CHECK(!blockchain::import_file(file_path.c_str(),
+        copy_path.c_str()));
+    DARK_CHECK(!fs::exists(copy_path));
+}
+
+void test_snapshot_isolation(record_layout layout)
+{
+    blockchain chain(scratch_path("isolation").c_str(), 3, layout);
+    // Enough outputs that a scan spans several windows
+    constexpr uint32_t outputs = 70000;
+    blockchain_batch puts;
+    for (uint32_t n = 0; n < outputs; ++n)
+        puts.put(test_point(n));
+    const auto indexes = chain.commit(puts);
+    DARK_CHECK(indexes && indexes->size() == outputs);
+    if (!indexes || indexes->size() != outputs)
+        return;
+    blockchain_batch removes;
+    for (uint32_t n = 0; n < outputs; n += 7)
+        removes.remove((*indexes)[n]);
+    DARK_CHECK(bool(chain.commit(removes)));
+
+    const auto view = chain.snapshot();
+    const auto before = live_records(*view, 0, view->count());
+    DARK_CHECK(before.size() == chain.live_count());
+
+    // Spent and new outputs after the snapshot stay out of its view
+    blockchain_batch changes;
+    for (uint32_t n = 1; n < outputs; n += 3)
+        if (n % 7 != 0)
+            changes.remove((*indexes)[n]);
+    for (uint32_t n = 0; n < 500; ++n)
+        changes.put(test_point(outputs + n));
+    DARK_CHECK(bool(chain.commit(changes)));
+    DARK_CHECK(chain.live_count() < before.size());
+
+    const auto after = live_records(*view, 0, view->count());
+    DARK_CHECK(after.size() == before.size());
+    for (const auto& entry: before)
+    {
+        const auto it = after.find(entry.first);
+        DARK_CHECK(it != after.end() &&
+            it->second.point == entry.second.point &&
+            it->second.time == entry.second.time);
+        DARK_CHECK(view->exists(entry.first));
+        DARK_CHECK(view->get(entry.first).point == entry.second.point);
+    }
+
+    const auto part = live_records(*view, 65000, 66000);
+    DARK_CHECK(part.size() == size_t(std::distance(
+        before.lower_bound(65000), before.lower_bound(66000))));
+
+    const auto now = chain.snapshot();
+    DARK_CHECK(live_records(*now, 0, now->count()).size() ==
+        chain.live_count());
+}
+
+// Unspent outputs of a three shard chain with every third one spent,
+// so shards end at different slots and leave unallocated indexes.
+output_index_list fill_with_gaps(blockchain& chain, uint32_t outputs)
+{
+    blockchain_batch puts;
+    for (uint32_t n = 0; n < outputs; ++n)
+        puts.put(test_point(n));
+    const auto indexes = chain.commit(puts);
+    DARK_CHECK(indexes && indexes->size() == outputs);
+    if (!indexes || indexes->size() != outputs)
+        return {};
+    blockchain_batch removes;
+    output_index_list live;
+    for (uint32_t n = 0; n < outputs; ++n)
+        if (n % 3 == 0)
+            removes.remove((*indexes)[n]);
+        else
+            live.push_back((*indexes)[n]);
+    DARK_CHECK(bool(chain.commit(removes)));
+    std::sort(live.begin(), live.end());
+    return live;
+}
+
+void test_snapshot_scan()
+{
+    blockchain chain(scratch_path("scan").c_str(), 3);
+    const auto live = fill_with_gaps(chain, 1000);
+    const auto view = chain.snapshot();
+    const auto expected = live_records(*view, 0, view->count());
+    DARK_CHECK(expected.size() == live.size());
+
+    // Each frame holds up to the limit and resumes where it stopped
+    output_index_list indexes, scanned;
+    std::vector<output_record> records;
+    output_index_type cursor = 0;
+    size_t frames = 0;
+    while (cursor != scan_complete)
+    {
+        const auto next = view->scan(cursor, 7, indexes, records);
+        DARK_CHECK(indexes.size() == records.size() && indexes.size() <= 7);
+        for (size_t i = 0; i < indexes.size(); ++i)
+        {
+            DARK_CHECK(indexes[i] >= cursor);
+            DARK_CHECK(scanned.empty() || indexes[i] > scanned.back());
+            const auto it = expected.find(indexes[i]);
+            DARK_CHECK(it != expected.end() &&
+                it->second.point == records[i].point);
+            scanned.push_back(indexes[i]);
+        }
+        // Only the last frame comes back short
+        DARK_CHECK(next == scan_complete || (indexes.size() == 7 &&
+            next > indexes.back()));
+        cursor = next;
+        ++frames;
+    }
+    DARK_CHECK(scanned == live);
+    DARK_CHECK(frames == (live.size() + 6) / 7 ||
+        frames == (live.size() + 6) / 7 + 1);
+
+    // A limit of 0 takes the largest frame
+    DARK_CHECK(view->scan(0, 0, indexes, records) == scan_complete);
+    DARK_CHECK(indexes == live);
+
+    // Starting on a spent slot skips to the next unspent one
+    output_index_type spent = 0;
+    while (std::binary_search(live.begin(), live.end(), spent))
+        ++spent;
+    const auto after = std::upper_bound(live.begin(), live.end(), spent);
+    DARK_CHECK(!view->exists(spent) && after != live.end());
+    view->scan(spent, 1, indexes, records);
+    DARK_CHECK(indexes.size() == 1 && indexes[0] == *after);
+
+    // Nothing past the end
+    DARK_CHECK(view->scan(view->count(), 10, indexes, records) ==
+        scan_complete && indexes.empty());
+    DARK_CHECK(view->scan(scan_complete, 10, indexes, records) ==
+        scan_complete && indexes.empty());
+
+    // Outputs spent after the snapshot are still scanned
+    blockchain_batch removes;
+    for (size_t i = 0; i < live.size(); i += 2)
+        removes.remove(live[i]);
+    DARK_CHECK(bool(chain.commit(removes)));
+    view->scan(0, 0, indexes, records);
+    DARK_CHECK(indexes == live);
+    DARK_CHECK(chain.snapshot()->scan(0, 0, indexes, records) ==
+        scan_complete && indexes.size() == live.size() / 2);
+}
+
+// What get_many and exists_many read for each requested index.
+void test_snapshot_batched_reads()
+{
+    blockchain chain(scratch_path("batched").c_str(), 3);
+    const auto live = fill_with_gaps(chain, 200);
+    const auto view = chain.snapshot();
+
+    // Spent, unallocated and past the end all read as not unspent
+    for (output_index_type index = 0; index < view->count() + 10; ++index)
+    {
+        const auto unspent = std::binary_search(live.begin(), live.end(),
+            index);
+        DARK_CHECK(view->exists(index) == unspent);
+        if (unspent)
+            DARK_CHECK(view->get(index).point == chain.get(index).point);
+    }
+    DARK_CHECK(!view->exists(scan_complete));
+
+    // And stay as they were for the snapshot
+    blockchain_batch removes;
+    removes.remove(live.front());
+    DARK_CHECK(bool(chain.commit(removes)));
+    DARK_CHECK(view->exists(live.front()));
+    DARK_CHECK(!chain.snapshot()->exists(live.front()));
+}
+
+void snapshot_tests()
+{
+    for (const auto layout: { record_layout::classic, record_layout::dense })
+    {
+        test_snapshot_file_round_trip(1, layout);
+        test_snapshot_file_round_trip(3, layout);
+        test_snapshot_isolation(layout);
+    }
+    test_snapshot_scan();
+    test_snapshot_batched_reads();
+}
+
+} // namespace test
+} // namespace dark
+
@@ -0,0 +1,38 @@
+#ifndef DARK_TEST_HPP
+#define DARK_TEST_HPP
+
+#include <string>
+#include <bitcoin/system.hpp>
+#include <dark/blockchain.hpp>
+
+namespace dark {
+namespace test {
+
+namespace bcs = bc::system;
+
+// Counts a failure and carries on, so one run reports every check.
+#define DARK_CHECK(expression) \
+    dark::test::check(expression, #expression, __FILE__, __LINE__)
+
+void check(bool passed, const char* expression, const char* file,
+    int line);
+size_t failures();
+
+// A valid point, distinct for each n.
+bcs::ec_compressed test_point(uint32_t n);
+// A path under the temp directory for one test, cleared of whatever
+// an earlier run left there.
+std::string scratch_path(const std::string& name);
+
+void feed_tests();
+void index_tests();
+void journal_tests();
+void merkle_tests();
+void sequencer_tests();
+void snapshot_tests();
+
+} // namespace test
+} // namespace dark
+
+#endif
+
@@ -0,0 +1,38 @@
+######################################################################
+# Chain storage tests. Build with qmake && make, then run darktech_test.
+######################################################################
+
+TEMPLATE = app
+TARGET = darktech_test
+CONFIG += console c++14
+CONFIG -= qt app_bundle
+INCLUDEPATH += . ../include/
+
+CONFIG += link_pkgconfig
+PKGCONFIG += libbitcoin-database libczmq
+
+QMAKE_CXXFLAGS += -g
+
+# Hardware popcount for the blockchain live bitmap
+contains(QT_ARCH, x86_64): QMAKE_CXXFLAGS += -mpopcnt
+
+# Input
+HEADERS += test.hpp
+SOURCES += main.cpp \
+    feed_test.cpp \
+    index_test.cpp \
+    journal_test.cpp \
+    merkle_test.cpp \
+    sequencer_test.cpp \
+    snapshot_test.cpp \
+    ../src/blockchain.cpp \
+    ../src/blockchain_snapshot.cpp \
+    ../src/chain_feed.cpp \
+    ../src/chain_sequencer.cpp \
+    ../src/commitment_index.cpp \
+    ../src/endpoints.cpp \
+    ../src/kernel_journal.cpp \
+    ../src/merkle_tree.cpp \
+    ../src/point_cache.cpp \
+    ../src/transaction.cpp \
+    ../src/utility.cpp